@@ -2,64 +2,136 @@
 //Preprocessor Commands and Macros
 //--------------------------------
 #define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
-#define GRAV_CONST 6.67408e-11
-#define BVALUES B[i].name, &B[i].mass, &B[i].p.x, &B[i].p.y, &B[i].p.z, &B[i].v.x, &B[i].v.y, &B[i].v.z
+#define BVALUES(name) name, &B[i].mass, &B[i].p.x, &B[i].p.y, &B[i].p.z, &B[i].v.x, &B[i].v.y, &B[i].v.z
 #define Bposition B[i].p.x, B[i].p.y, B[i].p.z
 #define Bvelocity B[i].v.x, B[i].v.y, B[i].v.z
 #include <time.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include "OrbitSim_v1.0.h"
 
-//Global variable for thread synchronizer
-pthread_barrier_t synchronizer;
+//Thread barriers, mapped memory, and the signal that follows a parent process's death are used throughout
+#ifndef __linux__
+#error "Orbit Sim builds only on Linux"
+#endif
+
+//Wall-clock seconds each mode is run for by the benchmark
+#define BENCH_SECONDS 2.0
+//Simulated seconds run by each reference scenario
+#define CHECK_DAY 86400
+//Time each scenario may take, as a multiple of the time it was measured to take
+#define CHECK_TIME_MARGIN 3.0
+//File of positions the sample system is compared with, kept next to the sample input, and the layout it must be in
+#define CHECK_SAMPLE_FILE "SampleCheck.csv"
+#define CHECK_SAMPLE_VERSION 1
+//Objects in the sample input
+#define SAMPLE_BODIES 5
+//Frames held by a stream unless set on the command line, one day of minutes
+#define STREAM_FRAMES 1440
 
 //------------------
 //Custom data types
 //------------------
 
-typedef struct
-{
-	double x;
-	double y;
-	double z;
-} vector;
-
 typedef enum {x = 0, y = 1, z = 2, end = 3} direction;
 
-typedef struct
-{
-	char name[96];
-	double mass;
-	vector p;
-	vector v;
-} body;
-
 typedef struct
 {
 	int days;
 	int totalbodies;
 	body *list;
+	arena memory;
+	char *streampath;
+	unsigned long streamframes;
+	int deterministic;
+	char *recordpath;
+	char *recordnames;
+	char *ephemerispath;
+	vector origin;
+	vector drift;
 } config;
 
+//A reference scenario, with its limits and results
+typedef struct CheckData CheckData;
+
+struct CheckData
+{
+	const char *name;
+	SimStatus (*run)(CheckData *);
+	double eccentricity;
+	double secondary;
+	double tolerance;
+	const char *unit;
+	double measured;
+	double limit;
+	double error;
+	double unregularized;
+	double seconds;
+	SimStatus status;
+	int passed;
+};
+
+//Position and mass of one body, as passed between ranks
 typedef struct
 {
-	body *list;
-	int totalbodies;
-	int num;
-	int* sim;
-	FILE *writefile;
-} ThreadData;
+	vector p;
+	double mu;
+} RankBody;
 
+//Memory shared by every rank
 typedef struct
 {
-	int days;
-	int* sim;
-} TimeData;
+	pthread_barrier_t synchronizer;
+	_Atomic int failed;
+	_Atomic int warned;
+} RankShared;
+
+typedef struct
+{
+	RankShared *shared;
+	RankBody *mailbox;
+	
+	//Copy of every position, and the state of the bodies this rank owns
+	RankBody *gathered;
+	vector *v;
+	vector *K1;
+	vector *NewP;
+	vector *NewV;
+	FILE **out;
+	int rank;
+	int ranks;
+	int n;
+	int first;
+	int last;
+	int blocksize;
+	unsigned long exchange;
+	unsigned long close;
+	
+	//Block being received from the previous rank
+	const RankBody *from;
+	RankBody *to;
+	size_t bytes;
+	int quit;
+	pthread_barrier_t handoff;
+	pthread_t receiver;
+	
+	//Process of each rank after the first, known only to rank zero
+	pid_t *children;
+} RankData;
 
 //-------------------
 //Function Prototypes
@@ -67,8 +139,8 @@ typedef struct
 
 //File IO functions
 void GetConfig(config *);
-int CountList(void *);
-void GetList(void *, body *);
+int CountList(void *, size_t *);
+void GetList(void *, body *, NameTable *);
 void Print(body *, int);
 
 //Error handling functions
@@ -81,21 +153,43 @@ void CheckDays(int);
 void ObjectsTooClose();
 void BadMalloc();
 void ThreadError();
-
-//vector functions
-vector VectorAdd(vector, vector);
-vector VectorSubtract(vector, vector);
-vector VectorMult(vector, double);
-vector VectorMultVector(vector, vector);
-vector VectorDivideBy(vector, double);
-double VectorMagnitudeSquared(vector);
+void RankError();
+void CheckStatus(SimStatus);
 
 //Simulation functions
-vector AccelerationSum(body *, vector, int, int);
+void RunSimulation(config *, int);
 void Simulate(config *);
 void SimulateMultithread(config *);
-void* TimekeeperThread(void *);
-void* SimThread(void *);
+
+//Benchmark functions
+double TimeSteps(simulation *, unsigned long *);
+int SameState(const simulation *, const simulation *);
+void Benchmark(config *, int);
+
+//Verification functions
+vector KeplerPosition(double, double, double, double);
+SimStatus CheckRun(CheckData *, body *, int, unsigned long, simulation **);
+SimStatus CheckRunWith(CheckData *, body *, int, unsigned long, int, simulation **);
+vector CheckPosition(const simulation *, int);
+SimStatus CheckKepler(CheckData *);
+SimStatus CheckCloseBinary(CheckData *);
+SimStatus CheckBinaryPlanet(CheckData *);
+SimStatus CheckFigureEight(CheckData *);
+void SampleBodies(body *);
+SimStatus ReadSampleCheck(const body *, int, vector *);
+SimStatus WriteSampleCheck();
+SimStatus CheckSample(CheckData *);
+void* CheckThread(void *);
+int RunChecks();
+
+//Distributed functions
+int RankFirst(int, int, int);
+vector RankAcceleration(const RankBody *, vector, int, int, int, int *);
+void* ReceiveThread(void *);
+void RankStep(RankData *);
+void RunRank(RankData *, config *);
+void* WatchRanks(void *);
+void SimulateDistributed(config *, int);
 
 
 //--------------------
@@ -122,9 +216,10 @@ void GetConfig(config *settings)
 	//Print message listing days read
 	fprintf(stderr, "\nSimulating orbits for %d days.", settings->days);
 	
-	//Run CountList function to determine number of objects in list
+	//Run CountList function to determine number of objects in list, and the length of their names
 	//This number is stored in settings
-	settings->totalbodies = CountList(in);
+	size_t TextSize;
+	settings->totalbodies = CountList(in, &TextSize);
 	
 	//Then close file
 	fclose(in);
@@ -138,29 +233,41 @@ void GetConfig(config *settings)
 	//Otherwise continue by opening file again
 	in = fopen("InitialConditions.ini", "r");
 	
-	//Allocate memory for the number of bodies counted previously
-	settings->list = malloc(sizeof(body) * settings->totalbodies);
+	//Allocate one block for the bodies counted previously and their names, with the name hash after them
+	//The rest is left for the output files RunSimulation opens
+	int n = settings->totalbodies;
+	size_t size = Aligned(sizeof(body) * n) + Aligned(TextSize) + Aligned(sizeof(unsigned int) * NameSlots(n))
+		+ Aligned(sizeof(FILE*) * n);
 	
 	//If allocation failed, go to BadMalloc function
-	if (settings->list == NULL)
+	if (ArenaCreate(&settings->memory, size) != SIM_OK)
 		BadMalloc();
 	
+	NameTable names;
+	settings->list = ArenaAlloc(&settings->memory, sizeof(body) * n);
+	char *text = ArenaAlloc(&settings->memory, TextSize);
+	NameTableInit(&names, text, ArenaAlloc(&settings->memory, sizeof(unsigned int) * NameSlots(n)), n);
+	
 	//Populate the memory with the data from each body
-	GetList(in, settings->list);
+	GetList(in, settings->list, &names);
 	
 	//Then close file
 	fclose(in);
 }
 
 //This function counts how many objects are stored in the list
-int CountList(void *file)
+//Also adds up the space their names take, counting the end of each
+int CountList(void *file, size_t *TextSize)
 {
 	//Start counter at zero
 	int n = 0;
+	char name[96];
+	*TextSize = 0;
 	
 	//Increment with each read until end of file
-	while (fscanf(file, "%*s mass, %*g position, %*g, %*g, %*g velocity, %*g, %*g, %*g") != EOF)
+	while (fscanf(file, "%95s mass, %*g position, %*g, %*g, %*g velocity, %*g, %*g, %*g", name) != EOF)
 	{
+		*TextSize = *TextSize + strlen(name) + 1;
 		n++;
 	}
 	
@@ -170,8 +277,11 @@ int CountList(void *file)
 }
 
 //This function reads the data stored on each body
-void GetList(void *in, body B[])
+//Names go into the table
+void GetList(void *in, body B[], NameTable *names)
 {
+	char name[96];
+	
 	//Read number of days again to go through buffer
 	fscanf(in, "days, %*d");
 	
@@ -179,8 +289,10 @@ void GetList(void *in, body B[])
 	int i = 0;
 	
 	//Reads data into the allocated memory location until end of file
-	while (fscanf(in, "%95s mass, %lg position, %lg, %lg, %lg velocity, %lg, %lg, %lg", BVALUES) != EOF)
+	while (fscanf(in, "%95s mass, %lg position, %lg, %lg, %lg velocity, %lg, %lg, %lg", BVALUES(name)) != EOF)
 	{
+		B[i].name = NameIntern(names, name);
+		
 		//Check for valid mass
 		if (0 > B[i].mass)
 		{
@@ -268,37 +380,31 @@ void CheckDays(int d)
 	}
 }
 
+//The five objects of the sample input, written out by GenerateSampleFile and run by the sample system check
+const body SampleSystem[SAMPLE_BODIES] = {
+	{.name = "Earth", .mass = 5.97e24, .p = {0, 0, 0}, .v = {0, 0, 0}},
+	{.name = "Moon", .mass = 7.34e22, .p = {3.84e8, 0, 0}, .v = {0, 1000, 0}},
+	{.name = "GeostationarySatellite", .mass = 1200, .p = {3.58e7, 0, 0}, .v = {0, 3070, 0}},
+	{.name = "InternationalSpaceStation", .mass = 419455, .p = {740626.73, -6644976.48, 1151109.69}, .v = {4724.433862, 1545.169511, 5838.010655}},
+	{.name = "LunarReconOrbiter", .mass = 1000, .p = {3.84e8, 0, 1.787e6}, .v = {-1600, 1000, 0}}};
+
 //This function creates a sample input file
+//Ten digits give back every value in the table exactly
 void GenerateSampleFile()
 {
 	FILE *sample = fopen("InitialConditions.ini", "w");
 	
 	fprintf(sample, "days, 27\n\n");
 	
-	fprintf(sample, "Earth\n");
-	fprintf(sample, "mass, 5.97e24\n");
-	fprintf(sample, "position, 0, 0, 0\n");
-	fprintf(sample, "velocity, 0, 0, 0\n\n");
-	
-	fprintf(sample, "Moon\n");
-	fprintf(sample, "mass, 7.34e22\n");
-	fprintf(sample, "position, 3.84e8, 0, 0\n");
-	fprintf(sample, "velocity, 0, 1000, 0\n\n");
-	
-	fprintf(sample, "GeostationarySatellite\n");
-	fprintf(sample, "mass, 1200\n");
-	fprintf(sample, "position, 3.58e7, 0, 0\n");
-	fprintf(sample, "velocity, 0, 3070, 0");
-	
-	fprintf(sample, "InternationalSpaceStation\n");
-	fprintf(sample, "mass, 419455\n");
-	fprintf(sample, "position, 740626.73, -6644976.48, 1151109.69\n");
-	fprintf(sample, "velocity, 4724.433862, 1545.169511, 5838.010655\n\n");
-	
-	fprintf(sample, "LunarReconOrbiter\n");
-	fprintf(sample, "mass, 1000\n");
-	fprintf(sample, "position, 3.84e8, 0, 1.787e6\n");
-	fprintf(sample, "velocity, -1600, 1000, 0\n\n");
+	//Print each object in the form GetList reads
+	const body *B = SampleSystem;
+	for (int i = 0; i < SAMPLE_BODIES; i++)
+	{
+		fprintf(sample, "%s\n", B[i].name);
+		fprintf(sample, "mass, %.10lg\n", B[i].mass);
+		fprintf(sample, "position, %.10lg, %.10lg, %.10lg\n", Bposition);
+		fprintf(sample, "velocity, %.10lg, %.10lg, %.10lg\n\n", Bvelocity);
+	}
 	
 	fclose(sample);
 	printf("\nSample file \"InitialConditions.ini\" has been created.");
@@ -340,550 +446,1067 @@ void ThreadError()
 	exit(0);
 }
 
+//Unlike the other errors, this one can come after output files were started, so it exits with a failure code
+void RankError()
+{
+	fprintf(stderr, "\nError: a rank process or its thread could not be started, or stopped early, so output is incomplete.");
+	fprintf(stderr, "\nTerminating program.");
+	exit(1);
+}
+
+//This function ends the program with the matching message if a library call failed
+void CheckStatus(SimStatus status)
+{
+	switch (status)
+	{
+		case SIM_OK:
+			return;
+		case SIM_BAD_MALLOC:
+			BadMalloc();
+			break;
+		case SIM_THREAD_ERROR:
+			ThreadError();
+			break;
+		case SIM_INSUFFICIENT_OBJECTS:
+			InsufficientObjects();
+			break;
+		case SIM_FILE_ERROR:
+			fprintf(stderr, "\nError: a stream or ephemeris file could not be created or read.");
+			fprintf(stderr, "\nTerminating program.");
+			exit(0);
+			break;
+		case SIM_EPHEMERIS_RANGE:
+			fprintf(stderr, "\nError: the simulation ran past the end of the ephemeris.");
+			fprintf(stderr, "\nRecord an ephemeris covering more days and restart.");
+			fprintf(stderr, "\nTerminating program.");
+			exit(0);
+			break;
+		case SIM_INVALID:
+			fprintf(stderr, "\nError: a simulation function was given an invalid argument.");
+			fprintf(stderr, "\nTerminating program.");
+			exit(0);
+			break;
+		case SIM_INVALID_MASS:
+			fprintf(stderr, "\nError: an object has a negative mass.");
+			fprintf(stderr, "\nTerminating program.");
+			exit(0);
+			break;
+	}
+}
+
 
 //--------------------
 //Function Definitions
-//Coordinate Substitution Functions
+//Simulation Functions
 //--------------------
 
-//This function sets the coordinates to the center of mass of the system
-//Also sets relative velocities
-void SetRelative(body objects[], int n)
+//Function to run the simulation from the settings read from file
+//Each body's position is written every minute, either to its own file or to the frame stream
+void RunSimulation(config *settings, int threads)
 {
-	//Initialize used quantities to zero
-	double ThisObjectMass = 0;
-	double TotalMass = 0;
+	//Alert user to start of simulation
+	fprintf(stderr, "\nBeginning Simulation...\n");
+	fprintf(stderr, "This may take some time. Please wait.");
 	
-	vector ThisObjectMomentum = {0, 0, 0};
-	vector TotalMomentum = {0, 0, 0};
+	int n = settings->totalbodies;
+	simulation *sim = NULL;
+	stream frames;
+	FILE **out = NULL;
 	
-	vector ThisObjectMoment = {0, 0, 0};
-	vector TotalMoment = {0, 0, 0};
+	ephemeris eph;
+	recorder rec;
 	
-	vector SystemVelocity = {0, 0, 0};
-	vector SystemCenter = {0, 0, 0};
+	CheckStatus(SimCreate(&sim, settings->list, n, threads));
+	SimSetDeterministic(sim, settings->deterministic);
+	SimSetFrame(sim, settings->origin, settings->drift);
+	fprintf(stderr, "\nSimulation state takes %.0lf bytes per object, %.2lf MB in one block%s.", (double) SimMemory(sim) / n,
+		SimMemory(sim) / 1048576.0, SimHugePages(sim) ? " on huge pages" : "");
 	
-	//Print message to user
-	fprintf(stderr, "\nSetting positions and velocities relative to center of system...");
-	for (int i = 0; i < n; i++)
+	//Drive the bodies found in an ephemeris file from that file
+	if (settings->ephemerispath != NULL)
 	{
-		//Increment through object list to find total mass
-		ThisObjectMass = objects[i].mass;
-		TotalMass = TotalMass + ThisObjectMass;
+		int matched, moved;
+		CheckStatus(EphemerisLoad(&eph, settings->ephemerispath));
+		CheckStatus(SimUseEphemeris(sim, &eph, &matched, &moved));
+		fprintf(stderr, "\n%d objects will follow the ephemeris in \"%s\".", matched, settings->ephemerispath);
 		
-		//Also total momentum of system for relative velocity
-		ThisObjectMomentum = VectorMult(objects[i].v, ThisObjectMass);
-		TotalMomentum = VectorAdd(TotalMomentum, ThisObjectMomentum);
+		//Their input positions and velocities are replaced, so say so if any of them differed
+		if (moved > 0)
+		{
+			fprintf(stderr, "\nWarning: %d of them start more than %.0lf m or %.2lf m/s from the ephemeris, and were moved onto it.",
+				moved, EPHEMERIS_TOLERANCE, EPHEMERIS_SPEED_TOLERANCE);
+		}
+	}
+	
+	//Or record the named bodies into one
+	if (settings->recordpath != NULL)
+	{
+		CheckStatus(EphemerisRecordStart(&rec, settings->recordpath, sim, settings->recordnames));
+		fprintf(stderr, "\nRecording %d objects into the ephemeris \"%s\".", rec.count, settings->recordpath);
+	}
+	
+	if (settings->streampath != NULL)
+	{
+		//Frames go to a fixed-size ring, so neither memory nor disk grows with the run
+		CheckStatus(StreamCreate(&frames, settings->streampath, settings->list, n, settings->streamframes));
+		fprintf(stderr, "\nStreaming %lu frames to \"%s\".", settings->streamframes, settings->streampath);
+	}
+	else
+	{
+		//Take space for array of file out pointers from what GetConfig left for it
+		out = ArenaAlloc(&settings->memory, sizeof(FILE*) * n);
 		
-		//And Moment of system for center of mass
-		ThisObjectMoment = VectorMult(objects[i].p, ThisObjectMass);
-		TotalMoment = VectorAdd(TotalMoment, ThisObjectMoment);
+		if (out == NULL)
+		{
+			BadMalloc();
+		}
+		
+		//Output file, numbered by input order so that each file follows its body through reordering
+		char filename[100];
+		for (int i = 0; i < n; i++)
+		{
+			snprintf(filename, sizeof(filename), "%s.csv", settings->list[i].name);
+			out[i] = fopen(filename, "w");
+		}
 	}
 	
-	//Get values for entire system by dividing total quantities by total system mass
-	SystemVelocity = VectorDivideBy(TotalMomentum, TotalMass);
-	SystemCenter = VectorDivideBy(TotalMoment, TotalMass);
+	//Create a very big integer to store the number of minutes to simulate
+	unsigned long sim_end_minutes = (unsigned long) settings->days * 24 * 60;
 	
-	//Print results to user
-	fprintf(stderr, "\nNet velocity of system found to be (%.3lg, %.3lg, %.3lg).", SystemVelocity.x, SystemVelocity.y, SystemVelocity.z);
-	fprintf(stderr, "\nCenter of mass of system found to be (%.3lg, %.3lg, %.3lg).", SystemCenter.x, SystemCenter.y, SystemCenter.z);
+	//Loop until time reaches end, one minute at a time
+	for (unsigned long minute = 0; minute < sim_end_minutes; minute++)
+	{
+		CheckStatus(SimStep(sim, 60));
+		
+		//Warn the user as soon as bodies come closer than the simulation can resolve
+		if (SimCloseEncounters(sim) > 0)
+		{
+			ObjectsTooClose();
+		}
+		
+		if (settings->recordpath != NULL)
+		{
+			EphemerisRecord(&rec, sim);
+		}
+		
+		if (out == NULL)
+		{
+			StreamPush(&frames, sim);
+			continue;
+		}
+		
+		//Print each object's position to its out file
+		const body *list = SimState(sim);
+		const int *index = SimIndex(sim);
+		for (int k = 0; k < n; k++)
+		{
+			fprintf(out[index[k]], "%.10lg, %.10lg, %.10lg,\n", list[k].p.x, list[k].p.y, list[k].p.z);
+		}
+	}
 	
-	//Set each object's coordinates to a new coordinate relative to the entire system
-	for (int i = 0; i < n; i++)
+	if (out == NULL)
 	{
-		objects[i].p = VectorSubtract(objects[i].p, SystemCenter);
-		objects[i].v = VectorSubtract(objects[i].v, SystemVelocity);
-	}	
+		StreamClose(&frames);
+	}
+	else
+	{
+		//Close the writing files
+		for (int k = 0; k < n; k++)
+		{
+			fclose(out[k]);
+		}
+	}
+	
+	SimDestroy(sim);
+	
+	if (settings->recordpath != NULL)
+	{
+		EphemerisRecordFinish(&rec);
+	}
+	if (settings->ephemerispath != NULL)
+	{
+		EphemerisFree(&eph);
+	}
+}
+
+//Function to begin simulation
+void Simulate(config *settings)
+{
+	RunSimulation(settings, 1);
+}
+
+//Function to begin simulation on one worker thread per processor
+void SimulateMultithread(config *settings)
+{
+	RunSimulation(settings, WorkerCount(settings->totalbodies));
 }
 
-//Function to multiply each body's mass by G
-void ComputeMG(body objects[], int n)
+
+//--------------------
+//Function Definitions
+//Benchmark Functions
+//--------------------
+
+//Steps a simulation for BENCH_SECONDS of wall-clock time, returning the steps per second and the steps taken
+double TimeSteps(simulation *sim, unsigned long *steps)
 {
+	struct timespec start;
+	struct timespec now;
+	double elapsed = 0;
+	
+	*steps = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (elapsed < BENCH_SECONDS)
+	{
+		CheckStatus(SimStep(sim, 60));
+		*steps = *steps + 60;
+		
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+	}
+	return *steps / elapsed;
+}
+
+//Returns true if two simulations hold the same positions and velocities, bit for bit, for every body
+int SameState(const simulation *a, const simulation *b)
+{
+	const body *ListA = SimState(a);
+	const body *ListB = SimState(b);
+	const int *IndexB = SimIndex(b);
+	const int *SlotA = SimSlot(a);
+	int n = SimBodies(a);
+	
 	for (int i = 0; i < n; i++)
 	{
-		objects[i].mass = objects[i].mass * GRAV_CONST;
+		const body *A = &ListA[SlotA[IndexB[i]]];
+		if (memcmp(&A->p, &ListB[i].p, sizeof(vector)) != 0 || memcmp(&A->v, &ListB[i].v, sizeof(vector)) != 0)
+		{
+			return 0;
+		}
 	}
+	return 1;
+}
+
+//Measures the cost of deterministic mode against the fast mode, and checks that it gives the same results on another thread count
+void Benchmark(config *settings, int threads)
+{
+	int n = settings->totalbodies;
+	int other = (threads > 1) ? 1 : 2;
+	unsigned long FastSteps;
+	unsigned long GeneralSteps;
+	unsigned long OrderedSteps;
+	simulation *fast = NULL;
+	simulation *general = NULL;
+	simulation *ordered = NULL;
+	simulation *check = NULL;
+	
+	fprintf(stderr, "\nBenchmarking each mode for %.1f seconds...", BENCH_SECONDS);
+	
+	CheckStatus(SimCreate(&fast, settings->list, n, threads));
+	double FastRate = TimeSteps(fast, &FastSteps);
+	int specialized = SimSpecialized(fast);
+	SimDestroy(fast);
+	
+	//Small systems are also timed without their kernel, which is the path deterministic mode takes
+	double GeneralRate = FastRate;
+	if (specialized)
+	{
+		CheckStatus(SimCreate(&general, settings->list, n, threads));
+		SimSetSpecialized(general, 0);
+		GeneralRate = TimeSteps(general, &GeneralSteps);
+		SimDestroy(general);
+	}
+	
+	CheckStatus(SimCreate(&ordered, settings->list, n, threads));
+	SimSetDeterministic(ordered, 1);
+	double OrderedRate = TimeSteps(ordered, &OrderedSteps);
+	
+	//Step a copy on another number of threads just as far
+	CheckStatus(SimCreate(&check, settings->list, n, other));
+	SimSetDeterministic(check, 1);
+	CheckStatus(SimStep(check, OrderedSteps));
+	int same = SameState(ordered, check);
+	size_t memory = SimMemory(check);
+	
+	SimDestroy(check);
+	SimDestroy(ordered);
+	
+	printf("\n\n\t=============== Benchmark ===============");
+	if (specialized)
+	{
+		printf("\n\tFast mode, kernel for %d bodies: %.4lg steps/s", n, FastRate);
+		printf("\n\tFast mode, general path: %.4lg steps/s on %d threads", GeneralRate, threads);
+		printf("\n\tSpeedup from kernel: %.2lfx", FastRate / GeneralRate);
+	}
+	else
+	{
+		printf("\n\tFast mode: %.4lg steps/s on %d threads", FastRate, threads);
+	}
+	printf("\n\tDeterministic mode: %.4lg steps/s on %d threads", OrderedRate, threads);
+	printf("\n\tDeterministic mode overhead: %.1lf%%", (GeneralRate / OrderedRate - 1.0) * 100.0);
+	printf("\n\tDeterministic results after %lu steps on %d and %d threads %s", OrderedSteps, threads, other, same ? "match" : "DIFFER");
+	printf("\n\tSimulation state: %.0lf bytes per body", (double) memory / n);
+	printf("\n\t=========================================\n");
 }
 
 
 //--------------------
 //Function Definitions
-//vector Functions
+//Verification Functions
 //--------------------
 
-//Function for a vector divided by a scalar
-vector VectorDivideBy(vector V, double C)
+//Solves Kepler's equation for the relative position of a two-body orbit that starts at periapsis on the x axis
+vector KeplerPosition(double a, double e, double mu, double t)
 {
-	double C2 = 1/C;
-	V.x = V.x * C2;
-	V.y = V.y * C2;
-	V.z = V.z * C2;
-	return V;
+	double M = sqrt(mu / (a * a * a)) * t;
+	double E = M;
+	
+	//Newton's method converges in a few steps for moderate eccentricity
+	for (int k = 0; k < 50; k++)
+	{
+		E = E - (E - e * sin(E) - M) / (1 - e * cos(E));
+	}
+	
+	vector r = {a * (cos(E) - e), a * sqrt(1 - e * e) * sin(E), 0};
+	return r;
 }
 
-//Function for a vector added to another vector
-vector VectorAdd(vector V, vector W)
+//Steps a set of bodies and records the time taken
+//The bodies are moved into the frame of their center of mass first, as on the command line
+SimStatus CheckRun(CheckData *check, body *bodies, int n, unsigned long seconds, simulation **sim)
 {
-	V.x = V.x + W.x;
-	V.y = V.y + W.y;
-	V.z = V.z + W.z;
-	return V;
+	return CheckRunWith(check, bodies, n, seconds, 1, sim);
 }
 
-//Function for a vector multiplied by a scalar
-vector VectorMult(vector V, double C)
+//Steps a set of bodies as CheckRun does, with the regularization of close pairs switched on or off
+SimStatus CheckRunWith(CheckData *check, body *bodies, int n, unsigned long seconds, int regularized, simulation **sim)
 {
-	V.x = V.x * C;
-	V.y = V.y * C;
-	V.z = V.z * C;
-	return V;
+	struct timespec start;
+	struct timespec stop;
+	SystemSums totals;
+	SimStatus status;
+	
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if ((status = SumSystem(bodies, n, 1, &totals)) == SIM_OK)
+	{
+		vector velocity = VectorDivideBy(totals.momentum, totals.mass);
+		vector center = VectorDivideBy(totals.moment, totals.mass);
+		for (int i = 0; i < n; i++)
+		{
+			bodies[i].p = VectorSubtract(bodies[i].p, center);
+			bodies[i].v = VectorSubtract(bodies[i].v, velocity);
+		}
+		
+		if ((status = SimCreate(sim, bodies, n, 1)) == SIM_OK)
+		{
+			SimSetRegularized(*sim, regularized);
+			status = SimStep(*sim, seconds);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	
+	check->seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+	return status;
+}
+
+//Returns the position of a body by input number
+vector CheckPosition(const simulation *sim, int k)
+{
+	return SimState(sim)[SimSlot(sim)[k]].p;
+}
+
+//Two bodies on a Kepler orbit, compared with the analytic solution after one day
+SimStatus CheckKepler(CheckData *check)
+{
+	double a = 4.2e7;
+	double e = check->eccentricity;
+	body bodies[2] = {{.name = "Primary", .mass = 5.97e24}, {.name = "Secondary", .mass = check->secondary}};
+	double mu = GRAV_CONST * (bodies[0].mass + bodies[1].mass);
+	
+	//Start the secondary at periapsis, moving along y
+	bodies[1].p = (vector) {a * (1 - e), 0, 0};
+	bodies[1].v = (vector) {0, sqrt(mu * (1 + e) / (a * (1 - e))), 0};
+	
+	simulation *sim = NULL;
+	SimStatus status = CheckRun(check, bodies, 2, CHECK_DAY, &sim);
+	
+	if (status == SIM_OK)
+	{
+		vector relative = VectorSubtract(CheckPosition(sim, 1), CheckPosition(sim, 0));
+		check->error = sqrt(VectorMagnitudeSquared(VectorSubtract(relative, KeplerPosition(a, e, mu, CHECK_DAY))));
+	}
+	SimDestroy(sim);
+	return status;
+}
+
+//Two small bodies 1000 m apart on an orbit of a few minutes, which only stays on the analytic solution when regularized
+//Periapsis is inside the 1000 m where forces were once clamped
+SimStatus CheckCloseBinary(CheckData *check)
+{
+	double a = 1000;
+	double e = check->eccentricity;
+	body bodies[2] = {{.name = "Primary", .mass = 1e16}, {.name = "Secondary", .mass = check->secondary}};
+	double mu = GRAV_CONST * (bodies[0].mass + bodies[1].mass);
+	
+	bodies[1].p = (vector) {a * (1 - e), 0, 0};
+	bodies[1].v = (vector) {0, sqrt(mu * (1 + e) / (a * (1 - e))), 0};
+	
+	simulation *sim = NULL;
+	SimStatus status = CheckRun(check, bodies, 2, CHECK_DAY, &sim);
+	
+	if (status == SIM_OK)
+	{
+		vector relative = VectorSubtract(CheckPosition(sim, 1), CheckPosition(sim, 0));
+		check->error = sqrt(VectorMagnitudeSquared(VectorSubtract(relative, KeplerPosition(a, e, mu, CHECK_DAY))));
+	}
+	SimDestroy(sim);
+	return status;
 }
 
-//Function for a vector subtracted by another vector
-vector VectorSubtract(vector V, vector W)
+//The close binary above with its center of mass on a circular orbit around a planet, run with and without regularization
+//The binary is far inside its Hill sphere, so its center of mass follows the planet's Kepler orbit but for a small tidal pull
+SimStatus CheckBinaryPlanet(CheckData *check)
 {
-	V.x = V.x - W.x;
-	V.y = V.y - W.y;
-	V.z = V.z - W.z;
-	return V;
+	double a = 1000;
+	double e = check->eccentricity;
+	double R = 4.2e7;
+	body bodies[3] = {{.name = "Planet", .mass = 5.97e24}, {.name = "Primary", .mass = 1e16}, {.name = "Secondary", .mass = check->secondary}};
+	double mu = GRAV_CONST * (bodies[1].mass + bodies[2].mass);
+	double MuOrbit = GRAV_CONST * (bodies[0].mass + bodies[1].mass + bodies[2].mass);
+	
+	//Split the relative orbit between the two bodies about a center of mass moving along y
+	vector center = {R, 0, 0};
+	vector velocity = {0, sqrt(MuOrbit / R), 0};
+	vector r = {a * (1 - e), 0, 0};
+	vector v = {0, sqrt(mu * (1 + e) / (a * (1 - e))), 0};
+	double share = bodies[2].mass / (bodies[1].mass + bodies[2].mass);
+	bodies[1].p = VectorSubtract(center, VectorMult(r, share));
+	bodies[1].v = VectorSubtract(velocity, VectorMult(v, share));
+	bodies[2].p = VectorAdd(center, VectorMult(r, 1 - share));
+	bodies[2].v = VectorAdd(velocity, VectorMult(v, 1 - share));
+	
+	double error[2] = {0, 0};
+	double seconds = 0;
+	SimStatus status = SIM_OK;
+	for (int regularized = 1; regularized >= 0 && status == SIM_OK; regularized--)
+	{
+		body copy[3];
+		memcpy(copy, bodies, sizeof(bodies));
+		
+		simulation *sim = NULL;
+		status = CheckRunWith(check, copy, 3, CHECK_DAY, regularized, &sim);
+		seconds = seconds + check->seconds;
+		
+		if (status == SIM_OK)
+		{
+			vector barycenter = VectorAdd(VectorMult(CheckPosition(sim, 1), 1 - share), VectorMult(CheckPosition(sim, 2), share));
+			vector relative = VectorSubtract(barycenter, CheckPosition(sim, 0));
+			error[regularized] = sqrt(VectorMagnitudeSquared(VectorSubtract(relative, KeplerPosition(R, 0, MuOrbit, CHECK_DAY))));
+		}
+		SimDestroy(sim);
+	}
+	
+	check->error = error[1];
+	check->unregularized = error[0];
+	check->seconds = seconds;
+	return status;
 }
 
-//Function for the magnitude (a scalar) squared
-double VectorMagnitudeSquared(vector V)
+//The figure-eight orbit of three equal masses, which returns to its starting point after one period
+//Its initial conditions, in units where G and each mass are one, are scaled so that the period is one day
+SimStatus CheckFigureEight(CheckData *check)
 {
-	V.x = V.x * V.x;
-	V.y = V.y * V.y;
-	V.z = V.z * V.z;
-	return (V.x + V.y + V.z);
+	double mass = 1e24;
+	double period = 6.32591398;
+	double TimeScale = CHECK_DAY / period;
+	double LengthScale = cbrt(GRAV_CONST * mass * TimeScale * TimeScale);
+	double SpeedScale = LengthScale / TimeScale;
+	
+	body bodies[3] = {{.name = "First", .mass = mass}, {.name = "Second", .mass = mass}, {.name = "Third", .mass = mass}};
+	bodies[0].p = VectorMult((vector) {0.97000436, -0.24308753, 0}, LengthScale);
+	bodies[1].p = VectorMult((vector) {-0.97000436, 0.24308753, 0}, LengthScale);
+	bodies[2].p = (vector) {0, 0, 0};
+	bodies[2].v = VectorMult((vector) {-0.93240737, -0.86473146, 0}, SpeedScale);
+	bodies[0].v = VectorMult(bodies[2].v, -0.5);
+	bodies[1].v = VectorMult(bodies[2].v, -0.5);
+	
+	simulation *sim = NULL;
+	SimStatus status = CheckRun(check, bodies, 3, CHECK_DAY, &sim);
+	
+	//Errors are given as a fraction of the size of the orbit
+	if (status == SIM_OK)
+	{
+		for (int k = 0; k < 3; k++)
+		{
+			double error = sqrt(VectorMagnitudeSquared(VectorSubtract(CheckPosition(sim, k), bodies[k].p))) / LengthScale;
+			check->error = fmax(check->error, error);
+		}
+	}
+	SimDestroy(sim);
+	return status;
+}
+
+//Fills bodies with the five objects of the sample input
+void SampleBodies(body *bodies)
+{
+	memcpy(bodies, SampleSystem, sizeof(SampleSystem));
+}
+
+//Reads the stored position of each body after one day from the sample check file
+//The file must be in the current layout, cover one day, and list the bodies by name in the same order
+SimStatus ReadSampleCheck(const body *bodies, int n, vector *golden)
+{
+	FILE *in = fopen(CHECK_SAMPLE_FILE, "r");
+	if (in == NULL)
+	{
+		return SIM_FILE_ERROR;
+	}
+	
+	int version = 0;
+	unsigned long seconds = 0;
+	SimStatus status = SIM_OK;
+	if (fscanf(in, " version, %d", &version) != 1 || version != CHECK_SAMPLE_VERSION
+		|| fscanf(in, " seconds, %lu", &seconds) != 1 || seconds != CHECK_DAY)
+	{
+		status = SIM_FILE_ERROR;
+	}
+	
+	for (int k = 0; k < n && status == SIM_OK; k++)
+	{
+		char name[96];
+		if (fscanf(in, " %95[^,], %lf, %lf, %lf", name, &golden[k].x, &golden[k].y, &golden[k].z) != 4
+			|| strcmp(name, bodies[k].name) != 0)
+		{
+			status = SIM_FILE_ERROR;
+		}
+	}
+	
+	fclose(in);
+	return status;
+}
+
+//Runs the sample system for one day and writes where each body ends up to the sample check file
+//Only for when a change to the integrator is meant to move the sample system; the file should then be committed with it
+SimStatus WriteSampleCheck()
+{
+	CheckData check = {.name = "Sample system"};
+	body bodies[SAMPLE_BODIES];
+	simulation *sim = NULL;
+	
+	SampleBodies(bodies);
+	SimStatus status = CheckRun(&check, bodies, SAMPLE_BODIES, CHECK_DAY, &sim);
+	
+	FILE *out = (status == SIM_OK) ? fopen(CHECK_SAMPLE_FILE, "w") : NULL;
+	if (status == SIM_OK && out == NULL)
+	{
+		status = SIM_FILE_ERROR;
+	}
+	
+	if (out != NULL)
+	{
+		//Seventeen digits read back to the same double
+		fprintf(out, "version, %d\nseconds, %d\n", CHECK_SAMPLE_VERSION, CHECK_DAY);
+		for (int k = 0; k < SAMPLE_BODIES; k++)
+		{
+			vector p = CheckPosition(sim, k);
+			fprintf(out, "%s, %.17g, %.17g, %.17g\n", bodies[k].name, p.x, p.y, p.z);
+		}
+		fclose(out);
+	}
+	
+	SimDestroy(sim);
+	return status;
+}
+
+//The sample system, compared with the positions after one day stored in the sample check file
+SimStatus CheckSample(CheckData *check)
+{
+	body bodies[SAMPLE_BODIES];
+	vector golden[SAMPLE_BODIES];
+	
+	SampleBodies(bodies);
+	SimStatus status = ReadSampleCheck(bodies, SAMPLE_BODIES, golden);
+	if (status != SIM_OK)
+	{
+		return status;
+	}
+	
+	simulation *sim = NULL;
+	status = CheckRun(check, bodies, SAMPLE_BODIES, CHECK_DAY, &sim);
+	
+	if (status == SIM_OK)
+	{
+		for (int k = 0; k < SAMPLE_BODIES; k++)
+		{
+			check->error = fmax(check->error, sqrt(VectorMagnitudeSquared(VectorSubtract(CheckPosition(sim, k), golden[k]))));
+		}
+	}
+	SimDestroy(sim);
+	return status;
+}
+
+//Runs one reference scenario and decides whether it passed
+void* CheckThread(void *arg)
+{
+	CheckData *check = (CheckData*) arg;
+	
+	check->error = 0;
+	check->limit = check->measured * CHECK_TIME_MARGIN;
+	check->status = check->run(check);
+	check->passed = (check->status == SIM_OK) && (check->error <= check->tolerance) && (check->seconds <= check->limit);
+	
+	//A scenario run both ways must also do better with regularization than without
+	check->passed = check->passed && (check->unregularized == 0 || check->error < check->unregularized);
+	return NULL;
+}
+
+//Runs every reference scenario, each on its own thread, and prints the results
+//Returns the number of scenarios that failed
+int RunChecks()
+{
+	//Times were measured in seconds with an optimized build, all six scenarios sharing one core, and may take three times as long
+	//Builds with sanitizers or without optimization are slower than this and will miss the time limits
+	CheckData checks[] = {
+		//Only the fourth-order error of each step is left for a light body, measured at 1.4e-6 m, so a millimeter shows any real fault
+		{.name = "Kepler orbit, light body", .run = CheckKepler, .eccentricity = 0.5, .secondary = 1000, .tolerance = 1e-3, .unit = "m", .measured = 0.05},
+		//Each step holds the other body where it was at the start, which lags the pull by half a step of its motion
+		//On a circular orbit that is a drag of G m1 m2 / M * v * h / a^3 along the orbit, which moves the body 3/2 * drag * t^2 behind
+		//For h = 1 s, a = 4.2e7 m and one day that is 2.27e3 m, measured at 2.31e3 m, and the limit is a little over twice it
+		{.name = "Kepler orbit, heavy pair", .run = CheckKepler, .eccentricity = 0.0, .secondary = 7.34e22, .tolerance = 5e3, .unit = "m", .measured = 0.05},
+		//Fourth order in the regularized substep, measured at 1.5 m with 128 substeps an orbit and 0.036 m with 512, limit about three times that
+		{.name = "Close binary", .run = CheckCloseBinary, .eccentricity = 0.5, .secondary = 1e16, .tolerance = 0.1, .unit = "m", .measured = 0.14},
+		//What is left is the tidal pull of the planet on the binary, which the Kepler orbit leaves out and which goes as a^2, measured at
+		//0.131, 0.0327 and 0.0084 m for a = 1000, 500 and 250 m, so the limit is under four times it; without regularization it is 5.8e5 m
+		{.name = "Binary around a planet", .run = CheckBinaryPlanet, .eccentricity = 0.5, .secondary = 1e16, .tolerance = 0.5, .unit = "m", .measured = 0.18},
+		//The lag of the heavy pair makes this first order in h over the period, measured at 0.0034, 0.0068 and 0.0137 with 86400, 43200 and 21600 steps
+		//an orbit, so the limit of 0.005 is one and a half times the error at this step, and fails if the error grows by half
+		{.name = "Figure-eight orbit", .run = CheckFigureEight, .tolerance = 5e-3, .unit = "of orbit", .measured = 0.08},
+		//Positions stored from this integrator, so the only allowed difference is a change in rounding
+		{.name = "Sample system", .run = CheckSample, .tolerance = 1e-3, .unit = "m", .measured = 0.14}};
+	int count = sizeof(checks) / sizeof(checks[0]);
+	int failed = 0;
+	
+	fprintf(stderr, "\nRunning %d reference scenarios...", count);
+	CheckStatus(RunParallel(CheckThread, checks, sizeof(CheckData), count));
+	
+	printf("\n\n\t=============== Reference Scenarios ===============");
+	for (int k = 0; k < count; k++)
+	{
+		//A scenario that could not run has no error or time to show
+		if (checks[k].status != SIM_OK)
+		{
+			printf("\n\t%-26s FAIL  could not run, %s", checks[k].name, (checks[k].status == SIM_FILE_ERROR)
+				? "a file it reads is missing or not in the current layout" : "the simulation returned an error");
+			failed++;
+			continue;
+		}
+		printf("\n\t%-26s %s  error %.3lg %s (limit %.3lg), %.2lf s (limit %.2lf s)", checks[k].name,
+			checks[k].passed ? "PASS" : "FAIL", checks[k].error, checks[k].unit, checks[k].tolerance, checks[k].seconds, checks[k].limit);
+		if (checks[k].unregularized > 0)
+		{
+			printf("\n\t%-26s       error %.3lg %s without regularization", "", checks[k].unregularized, checks[k].unit);
+		}
+		failed += !checks[k].passed;
+	}
+	printf("\n\t%d of %d scenarios passed", count - failed, count);
+	printf("\n\t===================================================\n");
+	return failed;
 }
 
 
 //--------------------
 //Function Definitions
-//Simulation Functions
+//Distributed Functions
 //--------------------
 
-//Function to find net acceleration on a body by iterating through list of other bodies
-//Needs list, current position of body, number of itself, and number of total bodies
-vector AccelerationSum(body *list, vector position, int i, int n)
+//Returns the first body owned by a rank, so that each rank owns a contiguous block of the input
+int RankFirst(int rank, int ranks, int n)
+{
+	return (int) ((long long) n * rank / ranks);
+}
+
+//Function to find the acceleration on a body from the bodies first to last of a compact block
+//Needs the same arguments as AccelerationSum, but sums only over part of the list
+vector RankAcceleration(const RankBody *list, vector position, int i, int first, int last, int *close)
 {
-	//Initialize variables to zero
 	vector a_sum = {0, 0, 0};
-	vector q = {0, 0, 0};
-	
 	double MagSquared;
-	double MagNegCubed;
-	double scalar;
 	
-	//Iterate through list of bodies, for each one not itself
-	for (int j = 0; j < n; j++)
+	for (int j = first; j < last; j++)
 	{
 		if (i != j)
 		{
-			//q is the distance vector from the jth body to the current one
-			q = VectorSubtract(list[j].p, position);
+			vector q = VectorSubtract(list[j].p, position);
 			
-			//If the distance <1000m, print error before continuing
+			//If the distance <1000m, count it before continuing
 			if ((MagSquared = VectorMagnitudeSquared(q)) < 1e6)
 			{
-				ObjectsTooClose();
+				(*close)++;
 				MagSquared = 1e6;
 			}
 			
-			//Convert quantity from ^2 to ^-3, then multiply by mass and G
-			MagNegCubed = pow(MagSquared, -1.5);
-			scalar = list[j].mass * MagNegCubed;
-			
-			//The net acceleration will be the sum of all these vectors times their scalar
-			a_sum = VectorAdd(a_sum, VectorMult(q, scalar));
+			a_sum = VectorAdd(a_sum, VectorMult(q, list[j].mu * InverseCube(MagSquared)));
 		}
 	}
-	//Return the sum of accelerations
 	return a_sum;
 }
 
-//Function to begin simulation
-void Simulate(config *settings)
+//Thread that takes blocks from the previous rank's mailbox while the rank sums forces on the block it holds
+void* ReceiveThread(void *arg)
 {
-	//Alert user to start of simulation
-	fprintf(stderr, "\nBeginning Simulation...\n");
-	fprintf(stderr, "This may take some time. Please wait.");
-	
-	//Create a very big integer to store the number of hours to simulate
-	unsigned long sim_end_hours = settings->days * 24;
+	RankData *r = (RankData*) arg;
 	
-	//Create integers to store the time currently simulated
-	unsigned long simtime_hours = 0;
-	int simtime_minutes = 0;
-	int simtime_seconds = 0;
-	
-	//Get the number of bodies for faster iteration
-	int n = settings->totalbodies;
-	int i;
-	
-	//Allocate space for 10 vectors for each object
-	vector *VectorSpace = malloc(sizeof(vector) * n * 10);
-	
-	//Go to malloc error if vector space is not created
-	if (VectorSpace == NULL)
+	while (1)
 	{
-		BadMalloc();
+		//Wait to be handed a block
+		pthread_barrier_wait(&r->handoff);
+		
+		if (r->quit)
+		{
+			break;
+		}
+		memcpy(r->to, r->from, r->bytes);
+		
+		//Hand the block back
+		pthread_barrier_wait(&r->handoff);
 	}
 	
-	//Define vector lists within allocated space using pointer arithmetic
-	vector *K1V = VectorSpace + 0 * n;
-	vector *K2V = VectorSpace + 1 * n;
-	vector *K3V = VectorSpace + 2 * n;
-	vector *K4V = VectorSpace + 3 * n;
-	
-	vector *K1R = VectorSpace + 4 * n;
-	vector *K2R = VectorSpace + 5 * n;
-	vector *K3R = VectorSpace + 6 * n;
-	vector *K4R = VectorSpace + 7 * n;
-	
-	vector *NewP = VectorSpace + 8 * n;
-	vector *NewV = VectorSpace + 9 * n;
-	
-	//Vectors for altered positions for each coefficient
-	vector K2V_pos = {0, 0, 0};
-	vector K3V_pos = {0, 0, 0};
-	vector K4V_pos= {0, 0, 0};
+	//return nothing useful
+	return NULL;
+}
+
+//Function to advance the bodies owned by a rank by one RK step
+//Blocks of positions are passed around the ring of ranks, and first-stage forces are summed against each block as it arrives
+//The later stages need every position, so they run on the gathered copy once the ring is complete
+void RankStep(RankData *r)
+{
+	int n = r->n;
+	int ranks = r->ranks;
+	int first = r->first;
+	int close = 0;
 	
 	//Set multipliers for RK method
 	double h = 1.0;
 	double half_h = h / 2.0;
 	double C = h / 6.0;
 	
-	//Initial position and initial velocity vectors
-	vector pi;
-	vector vi;
-	
-	//Vector for sum of K coefficients
-	vector sum_k;
-	
-	//Create space for array of file out pointers
-	FILE **out = malloc(sizeof(FILE*) * n);
-	
-	//Output file
-	for (int i = 0; i < n; i++)
+	for (int i = first; i < r->last; i++)
 	{
-		out[i] = fopen(strcat(settings->list[i].name, ".csv"), "w");
+		r->K1[i - first] = (vector) {0, 0, 0};
 	}
 	
-	//Loop until time reaches end
-	while (simtime_hours < sim_end_hours)
+	//Each rank starts with its own block, and passes on the block it holds at each stage
+	for (int stage = 0; stage < ranks; stage++)
 	{
+		int held = (r->rank - stage + ranks) % ranks;
+		int HeldFirst = RankFirst(held, ranks, n);
+		int HeldLast = RankFirst(held + 1, ranks, n);
 		
-		//Loop for each body in the list
-		for (i = 0; i < n; i++)
+		if (stage < ranks - 1)
 		{
-			pi = settings->list[i].p;
-			vi = settings->list[i].v;
+			//Mailboxes alternate between two slots, so a rank can post a block while its last one is still being read
+			int box = r->exchange & 1;
+			memcpy(r->mailbox + (size_t) (r->rank * 2 + box) * r->blocksize, r->gathered + HeldFirst, sizeof(RankBody) * (HeldLast - HeldFirst));
+			pthread_barrier_wait(&r->shared->synchronizer);
+			
+			//The previous rank has just posted the block this rank needs next
+			int next = (held - 1 + ranks) % ranks;
+			int NextFirst = RankFirst(next, ranks, n);
+			int previous = (r->rank - 1 + ranks) % ranks;
+			r->from = r->mailbox + (size_t) (previous * 2 + box) * r->blocksize;
+			r->to = r->gathered + NextFirst;
+			r->bytes = sizeof(RankBody) * (RankFirst(next + 1, ranks, n) - NextFirst);
+			pthread_barrier_wait(&r->handoff);
+			r->exchange++;
+		}
 		
-			K1V[i] = AccelerationSum(settings->list, pi, i, n);
-			K1R[i] = vi;
+		for (int i = first; i < r->last; i++)
+		{
+			r->K1[i - first] = VectorAdd(r->K1[i - first], RankAcceleration(r->gathered, r->gathered[i].p, i, HeldFirst, HeldLast, &close));
+		}
 		
-			K2V_pos = VectorAdd(pi, (VectorMult(K1R[i], half_h)));
-			K2V[i] = AccelerationSum(settings->list, K2V_pos, i, n);
-			K2R[i] = VectorAdd(vi, VectorMult(K1V[i], half_h));
+		//Wait for the next block to arrive
+		if (stage < ranks - 1)
+		{
+			pthread_barrier_wait(&r->handoff);
+		}
+	}
+	
+	for (int i = first; i < r->last; i++)
+	{
+		//Initial position and initial velocity vectors
+		vector pi = r->gathered[i].p;
+		vector vi = r->v[i - first];
 		
-			K3V_pos = VectorAdd(pi, (VectorMult(K2R[i], half_h)));
-			K3V[i] = AccelerationSum(settings->list, K3V_pos, i, n);
-			K3R[i] = VectorAdd(vi, VectorMult(K2V[i], half_h));
+		vector K1V = r->K1[i - first];
+		vector K1R = vi;
 		
-			K4V_pos = VectorAdd(pi, VectorMult(K3R[i], h));
-			K4V[i] = AccelerationSum(settings->list, K4V_pos, i, n);
-			K4R[i] = VectorAdd(vi, VectorMult(K3V[i], h));
+		vector K2V = RankAcceleration(r->gathered, VectorAdd(pi, (VectorMult(K1R, half_h))), i, 0, n, &close);
+		vector K2R = VectorAdd(vi, VectorMult(K1V, half_h));
 		
-			sum_k = VectorAdd(VectorAdd(K1V[i], VectorMult(K2V[i], 2.0)), VectorAdd(VectorMult(K3V[i], 2.0), K4V[i]));
-			NewV[i] = VectorAdd(vi, VectorMult(sum_k, C));
+		vector K3V = RankAcceleration(r->gathered, VectorAdd(pi, (VectorMult(K2R, half_h))), i, 0, n, &close);
+		vector K3R = VectorAdd(vi, VectorMult(K2V, half_h));
 		
-			sum_k = VectorAdd(VectorAdd(K1R[i], VectorMult(K2R[i], 2.0)), VectorAdd(VectorMult(K3R[i], 2.0), K4R[i])); 
-			NewP[i] = VectorAdd(pi, VectorMult(sum_k, C));
-			
-		}
+		vector K4V = RankAcceleration(r->gathered, VectorAdd(pi, VectorMult(K3R, h)), i, 0, n, &close);
+		vector K4R = VectorAdd(vi, VectorMult(K3V, h));
 		
-		//For each object in the list, update positions and velocities
-		for (i = 0; i < n; i++)
-		{
-			settings->list[i].p = NewP[i];
-			settings->list[i].v = NewV[i];
-		}
-		//Increment seconds
-		simtime_seconds++;
+		//Vector for sum of K coefficients
+		vector sum_k = VectorAdd(VectorAdd(K1V, VectorMult(K2V, 2.0)), VectorAdd(VectorMult(K3V, 2.0), K4V));
+		r->NewV[i - first] = VectorAdd(vi, VectorMult(sum_k, C));
 		
-		//If one minute has passed...
-		if (simtime_seconds == 60)
-		{
-			//Print each object's position to its out file
-			for (int k = 0; k < n; k++)
-			{
-				fprintf(out[k], "%.10lg, %.10lg, %.10lg,\n", settings->list[k].p.x, settings->list[k].p.y, settings->list[k].p.z);
-			}
-
-			//Increment time, reset seconds counter
-			simtime_minutes++;
-			simtime_seconds = 0;
-			
-			if (simtime_minutes == 60)
-			{
-				simtime_hours++;
-				simtime_minutes = 0;
-			}	
-		}		
+		sum_k = VectorAdd(VectorAdd(K1R, VectorMult(K2R, 2.0)), VectorAdd(VectorMult(K3R, 2.0), K4R));
+		r->NewP[i - first] = VectorAdd(pi, VectorMult(sum_k, C));
 	}
 	
-	//Free the space used by the vectors
-	free(VectorSpace);
-
-	//Close the writing files
-	for (int k = 0; k < n; k++)
+	//Other ranks read this rank's positions from its mailbox, so they can be updated in place
+	for (int i = first; i < r->last; i++)
 	{
-		fclose(out[k]);
-	};
-	free(out);
-
-	return;
+		r->gathered[i].p = r->NewP[i - first];
+		r->v[i - first] = r->NewV[i - first];
+	}
+	r->close += close;
 }
 
-void SimulateMultithread(config *settings)
+//Function run by each rank, which steps its own bodies and writes their positions every minute
+void RunRank(RankData *r, config *settings)
 {
-	//Set simulate to 1, or true
-	int simulate = 1;
-	fprintf(stderr,"\nBeginning simulation...\n");
-	fprintf(stderr, "This may take some time. Please wait.");
-	
-	//Initialize thread barrier for synchronization
-	//Total threads is the number of bodies, plus one for the time thread
-	pthread_barrier_init(&synchronizer, NULL, settings->totalbodies + 1);
+	r->first = RankFirst(r->rank, r->ranks, r->n);
+	r->last = RankFirst(r->rank + 1, r->ranks, r->n);
+	r->exchange = 0;
+	r->close = 0;
+	r->quit = 0;
 	
-	//Set ThreadArray to dynamically allocated space
-	pthread_t *ThreadArray = NULL;
-	ThreadArray = (pthread_t*) malloc(sizeof(pthread_t) * settings->totalbodies);
-	
-	//Call badmalloc function if thread pointers could not be set
-	if (ThreadArray == NULL)
+	for (int i = r->first; i < r->last; i++)
 	{
-		BadMalloc();
+		r->v[i - r->first] = settings->list[i].v;
 	}
 	
-	//Create reference to arguments for sim threads
-	ThreadData *ThreadArg;
-	
-	//Allocate space for write files
-	FILE **WriteFiles = NULL;
-	WriteFiles = (FILE**) malloc(sizeof(FILE**) * settings->totalbodies);
-	
-	//Check for malloc error
-	if (WriteFiles == NULL)
+	//Start the thread that receives blocks, and give up together if any rank could not
+	int receiving = 0;
+	if (r->ranks > 1)
 	{
-		BadMalloc();
+		pthread_barrier_init(&r->handoff, NULL, 2);
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, WORKER_STACK);
+		if (pthread_create(&r->receiver, &attr, ReceiveThread, (void*) r) == 0)
+		{
+			receiving = 1;
+		}
+		else
+		{
+			r->shared->failed = 1;
+		}
+		pthread_attr_destroy(&attr);
+		pthread_barrier_wait(&r->shared->synchronizer);
 	}
 	
-	//for each body in the list, assign a thread to a body to simulate
-	for (int i = 0; i < settings->totalbodies; i++)
+	if (!r->shared->failed)
 	{
-		//Allocate memory for thread data arguments for current thread
-		ThreadArg = NULL;
-		ThreadArg = (ThreadData*) malloc(sizeof(ThreadData));
-		
-		//Call badmalloc function if thread arg pointers could not be set
-		if (ThreadArg == NULL)
+		//Output file for each owned body
+		char filename[100];
+		for (int i = r->first; i < r->last; i++)
 		{
-			BadMalloc();
+			snprintf(filename, sizeof(filename), "%s.csv", settings->list[i].name);
+			r->out[i - r->first] = fopen(filename, "w");
 		}
 		
-		//Otherwise, continue by populating ThreadArg struct with appropriate data
-		ThreadArg->sim = &simulate;
-		ThreadArg->list = settings->list;
-		ThreadArg->totalbodies = settings->totalbodies;
-		ThreadArg->num = i;
-		
-		//Open file
-		WriteFiles[i] = fopen(strcat(settings->list[i].name, ".csv"), "w");
-		ThreadArg->writefile = WriteFiles[i];
+		//Loop until time reaches end, one minute at a time
+		unsigned long sim_end_minutes = (unsigned long) settings->days * 24 * 60;
+		for (unsigned long minute = 0; minute < sim_end_minutes; minute++)
+		{
+			for (int s = 0; s < 60; s++)
+			{
+				RankStep(r);
+			}
+			
+			for (int i = r->first; i < r->last; i++)
+			{
+				vector p = r->gathered[i].p;
+				fprintf(r->out[i - r->first], "%.10lg, %.10lg, %.10lg,\n", p.x, p.y, p.z);
+			}
+			
+			//Warn the user as soon as any rank sees bodies closer than the simulation can resolve, once for all ranks
+			if (r->close > 0 && !atomic_exchange(&r->shared->warned, 1))
+			{
+				ObjectsTooClose();
+			}
+		}
 		
-		//Create the pthread and assign it to SimThread, with ThreadArg cast as void pointer
-		if (pthread_create(&ThreadArray[i], NULL, SimThread, (void*) ThreadArg) == -1)
+		for (int i = r->first; i < r->last; i++)
 		{
-			//If there was an error, go to appropriate function
-			ThreadError();
+			fclose(r->out[i - r->first]);
 		}
 	}
 	
-	//Create a time thread
-	pthread_t TimeThread;
-	
-	//Create time thread argument
-	TimeData TimeArg = {.days = settings->days, .sim = &simulate};
-	
-	//Assign time thread to timekeeper task
-	if (pthread_create(&TimeThread, NULL, TimekeeperThread, (void*) &TimeArg) == -1)
+	if (receiving)
 	{
-		//If there was an error, go to appropriate function
-		ThreadError();
+		r->quit = 1;
+		pthread_barrier_wait(&r->handoff);
+		pthread_join(r->receiver, NULL);
 	}
-	
-	//Pointer used only for joining threads
-	void* end;
-	
-	//Iteratively join threads here
-	for (int i = 0; i < settings->totalbodies; i++)
+	if (r->ranks > 1)
 	{
-		if (pthread_join(ThreadArray[i], &end) == -1)
-		{
-			//If there was an error, go to appropriate function
-			ThreadError();
-		}
+		pthread_barrier_destroy(&r->handoff);
 	}
+}
+
+//Thread in rank zero that waits for every other rank to finish, and ends the run if one stops early
+//Rank zero shares a barrier with the others, so without this a rank that crashed would leave the rest waiting forever
+void* WatchRanks(void *arg)
+{
+	RankData *r = (RankData*) arg;
 	
-	//Join time thread too
-	if (pthread_join(TimeThread, &end) == -1)
+	for (int finished = 1; finished < r->ranks; finished++)
 	{
-		//If there was an error, go to appropriate function
-		ThreadError();
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		
+		if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			for (int k = 1; k < r->ranks; k++)
+			{
+				kill(r->children[k], SIGKILL);
+			}
+			
+			//Rank zero is stuck in the barrier, perhaps holding a file's lock, so leave without flushing files
+			fprintf(stderr, "\nError: a rank process stopped before the end of the run, so output is incomplete.");
+			fprintf(stderr, "\nTerminating program.");
+			_exit(1);
+		}
 	}
-	
-	pthread_barrier_destroy(&synchronizer);
-	free(WriteFiles);
+	return NULL;
 }
 
-//Function for simulating an object
-void* SimThread(void *arg)
+//Function to begin simulation on a number of processes, each owning a block of bodies
+//Ranks exchange positions through mailboxes in memory shared between them, so no message passing library is needed
+void SimulateDistributed(config *settings, int ranks)
 {
-	//Re-cast passed arguments as ThreadData struct
-	ThreadData *argument = (ThreadData*) arg;
-	
-	//Save important values from ThreadData to thread's stack
-	int i = argument->num;
-	int n = argument->totalbodies;
-	int* sim = argument->sim;
-	body *list = argument->list;
-	
-	//Declare variables used for RK calculation
-	vector pi = argument->list[i].p;
-	vector vi = argument->list[i].v;
-	
-	vector K2V_pos;
-	vector K3V_pos;
-	vector K4V_pos;
+	if (settings->streampath != NULL || settings->recordpath != NULL || settings->ephemerispath != NULL || settings->deterministic)
+	{
+		fprintf(stderr, "\nError: streaming, ephemerides and deterministic mode cannot be used with -p.");
+		fprintf(stderr, "\nTerminating program.");
+		exit(0);
+	}
 	
-	vector K1V;
-	vector K2V;
-	vector K3V;
-	vector K4V;
+	int n = settings->totalbodies;
+	ranks = (ranks < n) ? ranks : n;
 	
-	vector K1R;
-	vector K2R;
-	vector K3R;
-	vector K4R;
+	//Alert user to start of simulation
+	fprintf(stderr, "\nBeginning Simulation...\n");
+	fprintf(stderr, "This may take some time. Please wait.");
 	
-	vector sum_RK;
+	//Shared memory holds the barrier, the flags for a failed rank and for the warning about close bodies, and two mailbox slots for each rank
+	RankData r;
+	r.ranks = ranks;
+	r.n = n;
+	r.blocksize = (n + ranks - 1) / ranks;
+	size_t MailboxOffset = (sizeof(RankShared) + 63) & ~(size_t) 63;
+	size_t SharedSize = MailboxOffset + sizeof(RankBody) * 2 * ranks * r.blocksize;
 	
-	//Counter to determine how often to print
-	int counter = 0;
+	void *shared = mmap(NULL, SharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+	{
+		BadMalloc();
+	}
+	r.shared = (RankShared*) shared;
+	r.mailbox = (RankBody*) ((unsigned char*) shared + MailboxOffset);
+	r.shared->failed = 0;
+	r.shared->warned = 0;
+	
+	pthread_barrierattr_t attr;
+	pthread_barrierattr_init(&attr);
+	pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&r.shared->synchronizer, &attr, ranks);
+	pthread_barrierattr_destroy(&attr);
+	
+	//Space is made in one block before the ranks start, so each gets its own copy and none can fail part way
+	arena memory;
+	size_t size = Aligned(sizeof(RankBody) * n) + 4 * Aligned(sizeof(vector) * r.blocksize)
+		+ Aligned(sizeof(FILE*) * r.blocksize) + Aligned(sizeof(pid_t) * ranks);
+	if (ArenaCreate(&memory, size) != SIM_OK)
+	{
+		BadMalloc();
+	}
+	r.gathered = ArenaAlloc(&memory, sizeof(RankBody) * n);
+	r.v = ArenaAlloc(&memory, sizeof(vector) * r.blocksize);
+	r.K1 = ArenaAlloc(&memory, sizeof(vector) * r.blocksize);
+	r.NewP = ArenaAlloc(&memory, sizeof(vector) * r.blocksize);
+	r.NewV = ArenaAlloc(&memory, sizeof(vector) * r.blocksize);
+	r.out = ArenaAlloc(&memory, sizeof(FILE*) * r.blocksize);
+	r.children = ArenaAlloc(&memory, sizeof(pid_t) * ranks);
+	pid_t *children = r.children;
+	
+	//Every rank starts with all positions, the ring then keeps them current
+	for (int i = 0; i < n; i++)
+	{
+		r.gathered[i].p = settings->list[i].p;
+		r.gathered[i].mu = settings->list[i].mass * GRAV_CONST;
+	}
 	
-	//Set multipliers for RK method
-	double h = 1.0;
-	double half_h = h / 2.0;
-	double C = h / 6.0;
+	//Output still waiting in a buffer would be written again by every rank
+	fflush(stdout);
+	fflush(stderr);
 	
-	//Until the value is set to zero, the simulation loop continues
-	//Begin the RK iteration loop
-	while (*sim)
-	{		
-		K1V = AccelerationSum(list, pi, i, n);
-		K1R = vi;
+	//This process is rank zero, and starts the rest
+	pid_t parent = getpid();
+	for (int k = 1; k < ranks; k++)
+	{
+		children[k] = fork();
 		
-		K2V_pos = VectorAdd(pi, (VectorMult(K1R, half_h)));
-		K2V = AccelerationSum(list, K2V_pos, i, n);
-		K2R = VectorAdd(vi, VectorMult(K1V, half_h));
+		if (children[k] == 0)
+		{
+			//If rank zero dies, this rank is killed too rather than left waiting for it
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			if (getppid() != parent)
+			{
+				_exit(1);
+			}
 			
-		K3V_pos = VectorAdd(pi, (VectorMult(K2R, half_h)));
-		K3V = AccelerationSum(list, K3V_pos, i, n);
-		K3R = VectorAdd(vi, VectorMult(K2V, half_h));
-		
-		K4V_pos = VectorAdd(pi, VectorMult(K3R, h));
-		K4V = AccelerationSum(list, K4V_pos, i, n);
-		K4R = VectorAdd(vi, VectorMult(K3V, h));
-		
-		sum_RK = VectorAdd(VectorAdd(K1V, VectorMult(K2V, 2.0)), VectorAdd(VectorMult(K3V, 2.0), K4V));
-		vi = VectorAdd(vi, VectorMult(sum_RK, C));
-		
-		sum_RK = VectorAdd(VectorAdd(K1R, VectorMult(K2R, 2.0)), VectorAdd(VectorMult(K3R, 2.0), K4R)); 
-		pi = VectorAdd(pi, VectorMult(sum_RK, C));
+			r.rank = k;
+			RunRank(&r, settings);
+			_exit(0);
+		}
 		
-		//Assess if 60 seconds have been processed
-		if (counter == 60)
+		//Ranks already started would wait for the missing one forever
+		if (children[k] < 0)
 		{
-			//if so, reset counter and print a line at the current spot
-			counter = 0;
-			fprintf(argument->writefile, "%.10lg, %.10lg, %.10lg,\n", pi.x, pi.y, pi.z);
+			for (int c = 1; c < k; c++)
+			{
+				kill(children[c], SIGKILL);
+				waitpid(children[c], NULL, 0);
+			}
+			RankError();
 		}
-		
-		//Wait here for synchronization
-		pthread_barrier_wait(&synchronizer);
-		
-		//update new values for other threads to see
-		list[i].p = pi;
-		list[i].v = vi;
-		counter++;
-		
-		//Then wait again for synchronization
-		pthread_barrier_wait(&synchronizer);
 	}
 	
-	//close file once simulation is complete
-	fclose(argument->writefile);
-	
-	//free memory allocated to this thread
-	free(arg);
-	
-	//return nothing useful
-	return NULL;
-}
-
-void *TimekeeperThread(void *arg)
-{
-	//cast argument back as TimeData
-	TimeData *argument = (TimeData*) arg;
-	
-	//declare variables needed for timekeeping
-	int *simulate = argument->sim;
-	unsigned long EndHour = 24 * argument->days;
-	unsigned long CurrentHour = 0;
-	int CurrentSecond = 0;
-	
-	//loop for simulation
-	while (CurrentHour < EndHour)
+	//Watch the other ranks, and stop them all if that cannot be done
+	pthread_t watcher;
+	int watching = (ranks > 1);
+	if (watching && pthread_create(&watcher, NULL, WatchRanks, (void*) &r) != 0)
 	{
-	
-		//Increment time by one second
-		CurrentSecond = CurrentSecond + 1;
-		
-		//If one hour has passed, increment the hour and reset seconds
-		if (CurrentSecond == 3600)
+		for (int k = 1; k < ranks; k++)
 		{
-			CurrentSecond = 0;
-			CurrentHour = CurrentHour + 1;
+			kill(children[k], SIGKILL);
+			waitpid(children[k], NULL, 0);
 		}
-		
-		//Wait for worker threads to compute new vectors
-		pthread_barrier_wait(&synchronizer);	
-		
-		//Wait for worker threads to update values 
-		pthread_barrier_wait(&synchronizer);
+		RankError();
 	}
 	
-	//Wait for worker threads to compute new vectors
-	pthread_barrier_wait(&synchronizer);
+	r.rank = 0;
+	RunRank(&r, settings);
 	
-	//set simulation condition to end
-	*simulate = 0;
+	if (watching)
+	{
+		pthread_join(watcher, NULL);
+	}
 	
-	//Wait for worker threads to update new values
-	pthread_barrier_wait(&synchronizer);
+	if (r.shared->failed)
+	{
+		RankError();
+	}
 	
-	//Return nothing useful when finished, as nothing is needed
-	return NULL;
+	pthread_barrier_destroy(&r.shared->synchronizer);
+	munmap(shared, SharedSize);
+	ArenaFree(&memory);
 }
@@ -3,21 +3,93 @@
 
 int main(int argc, char *argv[])
 {
+	//Run the reference scenarios instead of a simulation, if asked, and report any failure in the exit code
+	if ((argc >= 2) && (strcmp(argv[1], "-t") == 0))
+	{
+		return (RunChecks() > 0);
+	}
+	
+	//Store new positions for the sample system check, when a change is meant to move it
+	if ((argc >= 2) && (strcmp(argv[1], "-g") == 0))
+	{
+		CheckStatus(WriteSampleCheck());
+		fprintf(stderr, "\nWrote the sample system's positions after one day to \"%s\".\n", CHECK_SAMPLE_FILE);
+		return 0;
+	}
+	
 	//Create configuration and get user settings from file
-	config settings = {.list = NULL};
+	config settings = {.list = NULL, .streampath = NULL, .streamframes = STREAM_FRAMES, .deterministic = 0,
+		.recordpath = NULL, .recordnames = NULL, .ephemerispath = NULL};
 	GetConfig(&settings);
+	
+	//Read command-line options
+	int multithread = 0;
+	int benchmark = 0;
+	int ranks = 0;
+	for (int a = 1; a < argc; a++)
+	{
+		if (strcmp(argv[a], "-m") == 0)
+		{
+			multithread = 1;
+		}
+		else if (strcmp(argv[a], "-d") == 0)
+		{
+			settings.deterministic = 1;
+		}
+		else if (strcmp(argv[a], "-b") == 0)
+		{
+			benchmark = 1;
+		}
+		else if ((strcmp(argv[a], "-r") == 0) && (a + 2 < argc))
+		{
+			settings.recordpath = argv[++a];
+			settings.recordnames = argv[++a];
+		}
+		else if ((strcmp(argv[a], "-e") == 0) && (a + 1 < argc))
+		{
+			settings.ephemerispath = argv[++a];
+		}
+		else if ((strcmp(argv[a], "-s") == 0) && (a + 1 < argc))
+		{
+			settings.streampath = argv[++a];
+		}
+		else if ((strcmp(argv[a], "-f") == 0) && (a + 1 < argc))
+		{
+			//A ring needs room for at least one frame
+			long frames = strtol(argv[++a], NULL, 10);
+			if (frames < 1)
+			{
+				fprintf(stderr, "\nError: the stream must hold at least one frame. %s was given.", argv[a]);
+				fprintf(stderr, "\nTerminating program.");
+				exit(0);
+			}
+			settings.streamframes = (unsigned long) frames;
+		}
+		else if ((strcmp(argv[a], "-p") == 0) && (a + 1 < argc))
+		{
+			ranks = atoi(argv[++a]);
+		}
+	}
 
 	//Set objects to their relative position
-	SetRelative(settings.list, settings.totalbodies);
+	CheckStatus(SetRelative(settings.list, settings.totalbodies, 0, &settings.origin, &settings.drift));
 	
-	//Change masses to masses times GRAV_CONST
-	ComputeMG(settings.list, settings.totalbodies);
-	
-	//Determine if command-line argument is applied
-	if ((argc >= 2) && (strcmp(argv[1], "-m") == 0))
+	//Compare the fast and deterministic modes instead of simulating, if asked
+	if (benchmark)
+	{
+		Benchmark(&settings, multithread ? WorkerCount(settings.totalbodies) : 1);
+	}
+	//Split the bodies between processes, if asked
+	else if (ranks > 0)
+	{
+		fprintf(stderr, "\nRunning simulation on %d processes.", (ranks < settings.totalbodies) ? ranks : settings.totalbodies);
+		SimulateDistributed(&settings, ranks);
+	}
+	//Determine if multithreading was asked for
+	else if (multithread)
 	{
 		//Start simulation on multiple threads
-		fprintf(stderr, "\nRunning simulation on %d threads.", (settings.totalbodies + 1));
+		fprintf(stderr, "\nRunning simulation on %d threads.", WorkerCount(settings.totalbodies));
 		SimulateMultithread(&settings);	
 	}
 	else
@@ -31,6 +103,6 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "\nSimulation complete.\n");
 	
 	//Free unused memory and quit
-	free(settings.list);
+	ArenaFree(&settings.memory);
 	return 0;
 }
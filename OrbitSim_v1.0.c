@@ -0,0 +1,2763 @@
+//--------------------------------
+//Preprocessor Commands and Macros
+//--------------------------------
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "OrbitSim_v1.0.h"
+
+//Thread barriers and mapped memory are used throughout
+#ifndef __linux__
+#error "Orbit Sim builds only on Linux"
+#endif
+
+//Spatial reordering runs once every this many simulated seconds
+#define REORDER_INTERVAL 3600
+//Each worker thread is handed this many tasks per step, leaving room to rebalance
+#define TASKS_PER_THREAD 8
+//Below this many bodies, helper passes are not worth spreading across threads
+#define PARALLEL_THRESHOLD 16384
+//Bits of each coordinate interleaved into a Morton key
+#define MORTON_BITS 21
+//Bodies per chunk in startup passes, fixed so that sums do not depend on the thread count
+#define INIT_CHUNK 4096
+//Contributions summed in order before entering the pairwise tree in deterministic mode
+#define PAIRWISE_BLOCK 8
+//Largest system stepped by a kernel specialized for its size
+//Past this the unrolled kernels measured no faster than the general path, and slower from 13 bodies
+#define SMALL_MAX 6
+//Pairs whose dynamical time sqrt(r^3 / G(m1 + m2)) is below this many seconds are integrated apart from the 1 second step
+#define ENCOUNTER_TIMESCALE 60.0
+//Close pairs are looked for once every this many simulated seconds
+#define ENCOUNTER_CHECK 60
+//Regularized substeps taken over each orbit of a close pair
+#define ENCOUNTER_SUBSTEPS 512
+//Pieces of an arena start on cache line boundaries
+#define ARENA_ALIGN 64
+//Size of a huge page, used for arenas of several of them
+#define HUGE_PAGE (2UL * 1024 * 1024)
+//Marks a file as an ephemeris, in the layout that stores the frame it was recorded in
+#define EPHEMERIS_MAGIC 0x4f524246
+//Simulated seconds covered by each segment of an ephemeris, and the degree of the polynomials fitted over it
+#define EPHEMERIS_SPAN 21600
+#define EPHEMERIS_DEGREE 12
+//Positions sampled once a minute over a segment, counting both ends
+#define EPHEMERIS_SAMPLES (EPHEMERIS_SPAN / 60 + 1)
+//Marks a file as a ring of streamed frames
+#define STREAM_MAGIC 0x4f524253
+
+//------------------
+//Custom data types
+//------------------
+
+typedef struct
+{
+	int first;
+	int last;
+	int close;
+} SimTask;
+
+typedef struct
+{
+	int top;
+	int bottom;
+	pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct
+{
+	simulation *sim;
+	int num;
+} ThreadData;
+
+struct simulation
+{
+	//Every buffer below, and the handle itself, is taken from this arena
+	arena memory;
+	
+	//State buffer
+	body *list;
+	int *index;
+	int *slot;
+	int totalbodies;
+	int deterministic;
+	int specialized;
+	unsigned long simtime;
+	unsigned long closeencounters;
+	
+	//Where the origin of the coordinates was at time zero in the input's frame, and its velocity
+	vector origin;
+	vector drift;
+	
+	//Ephemeris, and the ephemeris body driving each body by input number, or -1 for bodies that are integrated
+	const ephemeris *eph;
+	int *driven;
+	
+	//Partner of each body in a close pair by input number, or -1, and the number of pairs
+	//While searching is set, the worker pool looks for close pairs instead of stepping
+	int *partner;
+	int pairs;
+	int regularized;
+	int searching;
+	
+	//Space shared by the name table when the simulation is created, the sort along the Morton curve and the search for close pairs
+	void *scratch;
+	
+	//Space for the step, and the per-body cost estimates used to split it
+	vector *VectorSpace;
+	vector *NewP;
+	vector *NewV;
+	double *cost;
+	
+	//Worker pool, present only when more than one thread is used
+	int threads;
+	int totaltasks;
+	int running;
+	int launched;
+	SimTask *tasks;
+	TaskDeque *deques;
+	pthread_t *ThreadArray;
+	ThreadData *ThreadArg;
+	pthread_barrier_t synchronizer;
+	pthread_mutex_t LaunchLock;
+	pthread_cond_t LaunchSignal;
+};
+
+typedef struct
+{
+	body *list;
+	const body *source;
+	int *index;
+	int *slot;
+	double *cost;
+	SystemSums *partial;
+	vector center;
+	vector velocity;
+	int n;
+	int first;
+	int last;
+	int invalid;
+} InitData;
+
+typedef struct
+{
+	unsigned long long key;
+	int slot;
+} MortonEntry;
+
+typedef struct
+{
+	body *list;
+	MortonEntry *entries;
+	MortonEntry *merged;
+	double scale;
+	vector min;
+	vector max;
+	int first;
+	int middle;
+	int last;
+} ReorderData;
+
+//-------------------
+//Function Prototypes
+//-------------------
+
+//Coordinate substitution functions
+static int InitThreads(int, int);
+static void SplitChunks(InitData *, int, int);
+static void* TotalsThread(void *);
+static void* RelativeThread(void *);
+static void* CopyThread(void *);
+
+//Simulation functions
+static vector AccelerationSum(body *, vector, int, int, int *);
+static vector AccelerationSumOrdered(body *, const int *, vector, int, int, int *);
+static vector Acceleration(body *, const int *, vector, int, int, int *);
+static void StepBody(body *, const int *, int, int, vector *, vector *, int *);
+static void* SimThread(void *);
+
+//Small system kernel functions
+static void (*SmallKernel(const simulation *))(simulation *, unsigned long);
+
+//Close encounter functions
+static int FindEncounters(simulation *);
+static void NearestPartners(simulation *, int, int);
+static vector SourcePull(const body *, vector, int *);
+static void PairAcceleration(body *, const int *, int, int, vector, vector, int, vector *, vector *, int *);
+static void EncounterDerivatives(const double *, vector, double *);
+static void EncounterSubstep(double *, vector, double);
+static void EncounterStep(vector *, vector *, double, vector);
+static void StepPair(simulation *, int, int *);
+
+//Library functions
+static const int* SimOrder(const simulation *);
+static SimStatus SetDriven(simulation *, unsigned long, vector *, vector *);
+
+//Ephemeris functions
+static void ChebyshevTerms(double, double *, double *);
+
+//Frame stream functions
+static size_t StreamFrameSize(int);
+
+//Work scheduling functions
+static SimStatus StartWorkers(simulation *);
+static void PartitionTasks(simulation *);
+static int PopTask(TaskDeque *);
+static int StealTask(TaskDeque *);
+static void RunTask(simulation *, int);
+
+//Spatial ordering functions
+static unsigned long long MortonCoordinate(double);
+static unsigned long long MortonSpread(unsigned long long);
+static int CompareMorton(const void *, const void *);
+static size_t ReorderSize(int, int);
+static SimStatus SpatialReorder(body *, int *, int, int, void *);
+static void* BoundsThread(void *);
+static void* KeyThread(void *);
+static void* MergeThread(void *);
+
+
+//--------------------
+//Function Definitions
+//Coordinate Substitution Functions
+//--------------------
+
+//Returns the number of threads used for a startup pass over n bodies
+//A count of zero or less asks for one thread per processor
+int InitThreads(int n, int threads)
+{
+	//Small lists are handled on the calling thread
+	if (n < PARALLEL_THRESHOLD)
+	{
+		return 1;
+	}
+	return (threads <= 0) ? CountProcessors() : threads;
+}
+
+//Splits the chunks of a list of n bodies evenly between threads
+//Chunks have a fixed size, so the sums of each chunk never depend on the number of threads
+void SplitChunks(InitData *parts, int threads, int n)
+{
+	int chunks = (n + INIT_CHUNK - 1) / INIT_CHUNK;
+	
+	for (int t = 0; t < threads; t++)
+	{
+		parts[t].n = n;
+		parts[t].first = chunks * t / threads;
+		parts[t].last = chunks * (t + 1) / threads;
+	}
+}
+
+//Finds the mass, momentum and moment of each chunk of bodies handed to a thread
+static void* TotalsThread(void *arg)
+{
+	InitData *part = (InitData*) arg;
+	
+	for (int c = part->first; c < part->last; c++)
+	{
+		SystemSums sums = {0, {0, 0, 0}, {0, 0, 0}};
+		int stop = (c + 1) * INIT_CHUNK < part->n ? (c + 1) * INIT_CHUNK : part->n;
+		
+		for (int i = c * INIT_CHUNK; i < stop; i++)
+		{
+			double ThisObjectMass = part->source[i].mass;
+			sums.mass = sums.mass + ThisObjectMass;
+			sums.momentum = VectorAdd(sums.momentum, VectorMult(part->source[i].v, ThisObjectMass));
+			sums.moment = VectorAdd(sums.moment, VectorMult(part->source[i].p, ThisObjectMass));
+		}
+		part->partial[c] = sums;
+	}
+	return NULL;
+}
+
+//Moves each body handed to a thread into the frame of the center of mass
+static void* RelativeThread(void *arg)
+{
+	InitData *part = (InitData*) arg;
+	int stop = part->last * INIT_CHUNK < part->n ? part->last * INIT_CHUNK : part->n;
+	
+	for (int i = part->first * INIT_CHUNK; i < stop; i++)
+	{
+		part->list[i].p = VectorSubtract(part->list[i].p, part->center);
+		part->list[i].v = VectorSubtract(part->list[i].v, part->velocity);
+	}
+	return NULL;
+}
+
+//Copies the bodies handed to a thread into a simulation, checking each mass and multiplying it by G
+static void* CopyThread(void *arg)
+{
+	InitData *part = (InitData*) arg;
+	int stop = part->last * INIT_CHUNK < part->n ? part->last * INIT_CHUNK : part->n;
+	
+	part->invalid = 0;
+	for (int i = part->first * INIT_CHUNK; i < stop; i++)
+	{
+		part->list[i] = part->source[i];
+		part->list[i].mu = part->source[i].mass * GRAV_CONST;
+		part->invalid |= (0 > part->source[i].mass);
+		part->index[i] = i;
+		part->slot[i] = i;
+		
+		//Each body starts out with the same estimated cost
+		part->cost[i] = 1.0;
+	}
+	return NULL;
+}
+
+//Finds the total mass, momentum and moment of a list in one pass
+//Chunk sums are combined pairwise in a fixed order, so the totals are the same on any number of threads
+SimStatus SumSystem(const body objects[], int n, int threads, SystemSums *totals)
+{
+	//An empty list has no totals to find
+	if (n < 1)
+	{
+		return SIM_INVALID;
+	}
+	
+	threads = InitThreads(n, threads);
+	int chunks = (n + INIT_CHUNK - 1) / INIT_CHUNK;
+	
+	InitData *parts = malloc(sizeof(InitData) * threads);
+	SystemSums *partial = malloc(sizeof(SystemSums) * chunks);
+	
+	if (parts == NULL || partial == NULL)
+	{
+		free(partial);
+		free(parts);
+		return SIM_BAD_MALLOC;
+	}
+	
+	SplitChunks(parts, threads, n);
+	for (int t = 0; t < threads; t++)
+	{
+		parts[t].source = objects;
+		parts[t].partial = partial;
+	}
+	
+	SimStatus status = RunParallel(TotalsThread, parts, sizeof(InitData), threads);
+	
+	//Add neighbouring chunk sums, then neighbouring pairs, and so on up the tree
+	for (int width = 1; width < chunks; width = width * 2)
+	{
+		for (int c = 0; c + width < chunks; c = c + 2 * width)
+		{
+			partial[c].mass = partial[c].mass + partial[c + width].mass;
+			partial[c].momentum = VectorAdd(partial[c].momentum, partial[c + width].momentum);
+			partial[c].moment = VectorAdd(partial[c].moment, partial[c + width].moment);
+		}
+	}
+	*totals = partial[0];
+	
+	free(partial);
+	free(parts);
+	return status;
+}
+
+//This function sets the coordinates to the center of mass of the system
+//Also sets relative velocities
+//The center and velocity taken away are returned in center and velocity, unless they are NULL
+SimStatus SetRelative(body objects[], int n, int threads, vector *center, vector *velocity)
+{
+	SystemSums totals;
+	
+	if (n < 1)
+	{
+		return SIM_INVALID;
+	}
+	
+	//Print message to user
+	fprintf(stderr, "\nSetting positions and velocities relative to center of system...");
+	
+	SimStatus status = SumSystem(objects, n, threads, &totals);
+	if (status != SIM_OK)
+	{
+		return status;
+	}
+	
+	//Get values for entire system by dividing total quantities by total system mass
+	vector SystemVelocity = VectorDivideBy(totals.momentum, totals.mass);
+	vector SystemCenter = VectorDivideBy(totals.moment, totals.mass);
+	
+	//Print results to user
+	fprintf(stderr, "\nNet velocity of system found to be (%.3lg, %.3lg, %.3lg).", SystemVelocity.x, SystemVelocity.y, SystemVelocity.z);
+	fprintf(stderr, "\nCenter of mass of system found to be (%.3lg, %.3lg, %.3lg).", SystemCenter.x, SystemCenter.y, SystemCenter.z);
+	
+	if (center != NULL)
+	{
+		*center = SystemCenter;
+	}
+	if (velocity != NULL)
+	{
+		*velocity = SystemVelocity;
+	}
+	
+	//Set each object's coordinates to a new coordinate relative to the entire system
+	threads = InitThreads(n, threads);
+	InitData *parts = malloc(sizeof(InitData) * threads);
+	
+	if (parts == NULL)
+	{
+		return SIM_BAD_MALLOC;
+	}
+	
+	SplitChunks(parts, threads, n);
+	for (int t = 0; t < threads; t++)
+	{
+		parts[t].list = objects;
+		parts[t].center = SystemCenter;
+		parts[t].velocity = SystemVelocity;
+	}
+	
+	status = RunParallel(RelativeThread, parts, sizeof(InitData), threads);
+	free(parts);
+	return status;
+}
+
+
+//--------------------
+//Function Definitions
+//Spatial Ordering Functions
+//--------------------
+
+//Returns the number of processors available for helper threads
+int CountProcessors()
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (int) count : 1;
+}
+
+//Runs a task on count threads, handing each thread its own slice of the argument array
+SimStatus RunParallel(void *(*task)(void *), void *args, size_t size, int count)
+{
+	//A single task is run directly on the calling thread
+	if (count == 1)
+	{
+		task(args);
+		return SIM_OK;
+	}
+	
+	pthread_t *helpers = malloc(sizeof(pthread_t) * count);
+	
+	if (helpers == NULL)
+	{
+		return SIM_BAD_MALLOC;
+	}
+	
+	//Helpers that did start are still joined if a later one fails
+	SimStatus status = SIM_OK;
+	int started = 0;
+	while (started < count)
+	{
+		if (pthread_create(&helpers[started], NULL, task, (char*) args + started * size) != 0)
+		{
+			status = SIM_THREAD_ERROR;
+			break;
+		}
+		started++;
+	}
+	
+	for (int i = 0; i < started; i++)
+	{
+		if (pthread_join(helpers[i], NULL) != 0)
+		{
+			status = SIM_THREAD_ERROR;
+		}
+	}
+	
+	free(helpers);
+	return status;
+}
+
+//Clamps a scaled coordinate into the range of a key before it is converted
+//Coordinates that are not a number sort first, and infinite ones go to either end
+unsigned long long MortonCoordinate(double q)
+{
+	double top = (1 << MORTON_BITS) - 1;
+	
+	if (!(q > 0))
+	{
+		return 0;
+	}
+	return (unsigned long long) ((q < top) ? q : top);
+}
+
+//Spreads the low 21 bits of a coordinate so that two zero bits follow each one
+unsigned long long MortonSpread(unsigned long long c)
+{
+	c = c & 0x1fffff;
+	c = (c | c << 32) & 0x1f00000000ffffULL;
+	c = (c | c << 16) & 0x1f0000ff0000ffULL;
+	c = (c | c << 8) & 0x100f00f00f00f00fULL;
+	c = (c | c << 4) & 0x10c30c30c30c30c3ULL;
+	c = (c | c << 2) & 0x1249249249249249ULL;
+	return c;
+}
+
+//Orders entries by key, and by list position for equal keys so the order never depends on the sort
+int CompareMorton(const void *a, const void *b)
+{
+	const MortonEntry *A = a;
+	const MortonEntry *B = b;
+	
+	if (A->key != B->key)
+	{
+		return (A->key < B->key) ? -1 : 1;
+	}
+	return (A->slot > B->slot) - (A->slot < B->slot);
+}
+
+//Finds the bounding box of one chunk of the list
+static void* BoundsThread(void *arg)
+{
+	ReorderData *chunk = (ReorderData*) arg;
+	
+	chunk->min = chunk->list[chunk->first].p;
+	chunk->max = chunk->list[chunk->first].p;
+	
+	for (int i = chunk->first; i < chunk->last; i++)
+	{
+		vector p = chunk->list[i].p;
+		chunk->min.x = fmin(chunk->min.x, p.x);
+		chunk->min.y = fmin(chunk->min.y, p.y);
+		chunk->min.z = fmin(chunk->min.z, p.z);
+		chunk->max.x = fmax(chunk->max.x, p.x);
+		chunk->max.y = fmax(chunk->max.y, p.y);
+		chunk->max.z = fmax(chunk->max.z, p.z);
+	}
+	return NULL;
+}
+
+//Computes the Morton key of each body in one chunk, then sorts the chunk
+static void* KeyThread(void *arg)
+{
+	ReorderData *chunk = (ReorderData*) arg;
+	
+	for (int i = chunk->first; i < chunk->last; i++)
+	{
+		vector q = VectorMult(VectorSubtract(chunk->list[i].p, chunk->min), chunk->scale);
+		
+		chunk->entries[i].key = MortonSpread(MortonCoordinate(q.x))
+			| MortonSpread(MortonCoordinate(q.y)) << 1
+			| MortonSpread(MortonCoordinate(q.z)) << 2;
+		chunk->entries[i].slot = i;
+	}
+	
+	qsort(chunk->entries + chunk->first, chunk->last - chunk->first, sizeof(MortonEntry), CompareMorton);
+	return NULL;
+}
+
+//Merges two neighbouring sorted runs of entries into the other entry buffer
+static void* MergeThread(void *arg)
+{
+	ReorderData *run = (ReorderData*) arg;
+	
+	int a = run->first;
+	int b = run->middle;
+	int k = run->first;
+	
+	while (a < run->middle && b < run->last)
+	{
+		run->merged[k++] = (CompareMorton(&run->entries[b], &run->entries[a]) < 0) ? run->entries[b++] : run->entries[a++];
+	}
+	while (a < run->middle)
+	{
+		run->merged[k++] = run->entries[a++];
+	}
+	while (b < run->last)
+	{
+		run->merged[k++] = run->entries[b++];
+	}
+	return NULL;
+}
+
+//Returns the scratch space SpatialReorder needs to sort n bodies on a number of threads
+size_t ReorderSize(int n, int threads)
+{
+	threads = (n < PARALLEL_THRESHOLD) ? 1 : threads;
+	
+	//A single sorted run has nothing to merge, so it needs no second buffer of entries
+	int buffers = (threads > 1) ? 2 : 1;
+	return Aligned(sizeof(MortonEntry) * n * buffers) + 2 * Aligned(sizeof(ReorderData) * threads) + Aligned(sizeof(int) * (threads + 1));
+}
+
+//This function sorts the list along a Morton curve so that bodies near each other in space sit near each other in memory
+//The index array is permuted alongside, so index[i] always holds the input number of the body at list[i]
+//Space is the scratch of ReorderSize(n, threads) bytes, and the bodies are moved within the list without a copy of it
+SimStatus SpatialReorder(body list[], int index[], int n, int threads, void *space)
+{
+	//Small lists are sorted on the calling thread
+	if (n < PARALLEL_THRESHOLD)
+	{
+		threads = 1;
+	}
+	
+	//Lay out the scratch space with pointer arithmetic, in the order ReorderSize adds it up
+	SimStatus status = SIM_OK;
+	char *next = space;
+	MortonEntry *entries = (MortonEntry*) next;
+	MortonEntry *merged = (threads > 1) ? entries + n : NULL;
+	next = next + Aligned(sizeof(MortonEntry) * n * ((threads > 1) ? 2 : 1));
+	ReorderData *chunks = (ReorderData*) next;
+	next = next + Aligned(sizeof(ReorderData) * threads);
+	ReorderData *pairs = (ReorderData*) next;
+	next = next + Aligned(sizeof(ReorderData) * threads);
+	int *bounds = (int*) next;
+	
+	//Split the list into one contiguous chunk per thread
+	for (int t = 0; t < threads; t++)
+	{
+		chunks[t] = (ReorderData) {.list = list, .entries = entries, .merged = merged,
+			.first = (int) ((long) n * t / threads), .last = (int) ((long) n * (t + 1) / threads)};
+	}
+	
+	//Find the bounding box of the whole system from the box of each chunk
+	if ((status = RunParallel(BoundsThread, chunks, sizeof(ReorderData), threads)) != SIM_OK)
+	{
+		return status;
+	}
+	
+	vector min = chunks[0].min;
+	vector max = chunks[0].max;
+	for (int t = 1; t < threads; t++)
+	{
+		min.x = fmin(min.x, chunks[t].min.x);
+		min.y = fmin(min.y, chunks[t].min.y);
+		min.z = fmin(min.z, chunks[t].min.z);
+		max.x = fmax(max.x, chunks[t].max.x);
+		max.y = fmax(max.y, chunks[t].max.y);
+		max.z = fmax(max.z, chunks[t].max.z);
+	}
+	
+	//Scale the largest side of the box onto the range of a Morton coordinate
+	double extent = fmax(max.x - min.x, fmax(max.y - min.y, max.z - min.z));
+	double scale = (extent > 0) ? ((1 << MORTON_BITS) - 1) / extent : 0;
+	
+	for (int t = 0; t < threads; t++)
+	{
+		chunks[t].min = min;
+		chunks[t].scale = scale;
+	}
+	
+	//Key and sort each chunk
+	if ((status = RunParallel(KeyThread, chunks, sizeof(ReorderData), threads)) != SIM_OK)
+	{
+		return status;
+	}
+	
+	//Merge sorted runs pairwise until a single run remains
+	for (int t = 0; t < threads; t++)
+	{
+		bounds[t] = chunks[t].first;
+	}
+	bounds[threads] = n;
+	
+	int runs = threads;
+	while (runs > 1)
+	{
+		int merges = (runs + 1) / 2;
+		
+		for (int m = 0; m < merges; m++)
+		{
+			//An unpaired last run is merged with an empty run, which copies it across
+			int last = (2 * m + 2 <= runs) ? bounds[2 * m + 2] : bounds[runs];
+			pairs[m] = (ReorderData) {.entries = entries, .merged = merged,
+				.first = bounds[2 * m], .middle = (2 * m + 1 <= runs) ? bounds[2 * m + 1] : last, .last = last};
+		}
+		
+		if ((status = RunParallel(MergeThread, pairs, sizeof(ReorderData), merges)) != SIM_OK)
+		{
+			return status;
+		}
+		
+		for (int m = 0; m < merges; m++)
+		{
+			bounds[m] = pairs[m].first;
+		}
+		bounds[merges] = n;
+		runs = merges;
+		
+		//The merged buffer now holds the sorted runs
+		MortonEntry *swap = entries;
+		entries = merged;
+		merged = swap;
+	}
+	
+	//Move bodies and their input numbers into sorted order by following each cycle of the permutation,
+	//where position i takes the body from entries[i].slot, and mark each position filled by pointing its entry at itself
+	for (int i = 0; i < n; i++)
+	{
+		if (entries[i].slot == i)
+		{
+			continue;
+		}
+		body held = list[i];
+		int HeldIndex = index[i];
+		
+		int k = i;
+		while (entries[k].slot != i)
+		{
+			int from = entries[k].slot;
+			list[k] = list[from];
+			index[k] = index[from];
+			entries[k].slot = k;
+			k = from;
+		}
+		list[k] = held;
+		index[k] = HeldIndex;
+		entries[k].slot = k;
+	}
+	return SIM_OK;
+}
+
+
+//--------------------
+//Function Definitions
+//vector Functions
+//--------------------
+
+//Function for a vector divided by a scalar
+vector VectorDivideBy(vector V, double C)
+{
+	double C2 = 1/C;
+	V.x = V.x * C2;
+	V.y = V.y * C2;
+	V.z = V.z * C2;
+	return V;
+}
+
+//Function for a vector added to another vector
+vector VectorAdd(vector V, vector W)
+{
+	V.x = V.x + W.x;
+	V.y = V.y + W.y;
+	V.z = V.z + W.z;
+	return V;
+}
+
+//Function for a vector multiplied by a scalar
+vector VectorMult(vector V, double C)
+{
+	V.x = V.x * C;
+	V.y = V.y * C;
+	V.z = V.z * C;
+	return V;
+}
+
+//Function for a vector subtracted by another vector
+vector VectorSubtract(vector V, vector W)
+{
+	V.x = V.x - W.x;
+	V.y = V.y - W.y;
+	V.z = V.z - W.z;
+	return V;
+}
+
+//Function for the magnitude (a scalar) squared
+double VectorMagnitudeSquared(vector V)
+{
+	V.x = V.x * V.x;
+	V.y = V.y * V.y;
+	V.z = V.z * V.z;
+	return (V.x + V.y + V.z);
+}
+
+
+//--------------------
+//Function Definitions
+//Simulation Functions
+//--------------------
+
+//Converts a squared distance to the inverse cube of the distance
+//A square root and a division take a fraction of the time of pow, and round the same way on any machine, so deterministic mode uses them too
+double InverseCube(double MagSquared)
+{
+	return 1.0 / (MagSquared * sqrt(MagSquared));
+}
+
+//Function to find net acceleration on a body by iterating through list of other bodies
+//Needs list, current position of body, number of itself, number of total bodies, and a count of close approaches to add to
+vector AccelerationSum(body *list, vector position, int i, int n, int *close)
+{
+	//Initialize variables to zero
+	vector a_sum = {0, 0, 0};
+	vector q = {0, 0, 0};
+	
+	double MagSquared;
+	double MagNegCubed;
+	double scalar;
+	
+	//Iterate through list of bodies, for each one not itself
+	for (int j = 0; j < n; j++)
+	{
+		if (i != j)
+		{
+			//q is the distance vector from the jth body to the current one
+			q = VectorSubtract(list[j].p, position);
+			
+			//If the distance <1000m, count it before continuing
+			if ((MagSquared = VectorMagnitudeSquared(q)) < 1e6)
+			{
+				(*close)++;
+				MagSquared = 1e6;
+			}
+			
+			//Convert quantity from ^2 to ^-3, then multiply by mass and G
+			MagNegCubed = InverseCube(MagSquared);
+			scalar = list[j].mu * MagNegCubed;
+			
+			//The net acceleration will be the sum of all these vectors times their scalar
+			a_sum = VectorAdd(a_sum, VectorMult(q, scalar));
+		}
+	}
+	//Return the sum of accelerations
+	return a_sum;
+}
+
+//Function to find net acceleration on a body in deterministic mode
+//Bodies are visited in input order through slot, and their contributions are added in a fixed pairwise tree,
+//so the sum depends neither on where bodies sit in the list nor on how the step is split between threads
+vector AccelerationSumOrdered(body *list, const int *slot, vector position, int i, int n, int *close)
+{
+	//Partial sums waiting to be joined, one for each level of the tree
+	vector stack[64];
+	int depth = 0;
+	unsigned long blocks = 0;
+	
+	double MagSquared;
+	double scalar;
+	
+	for (int k = 0; k < n; k = k + PAIRWISE_BLOCK)
+	{
+		//Add up one block of bodies in order
+		vector block_sum = {0, 0, 0};
+		int stop = (k + PAIRWISE_BLOCK < n) ? k + PAIRWISE_BLOCK : n;
+		
+		for (int m = k; m < stop; m++)
+		{
+			int j = slot[m];
+			
+			//A body adds nothing to itself, but keeps its place so the tree has the same shape for every body
+			if (i != j)
+			{
+				vector q = VectorSubtract(list[j].p, position);
+				
+				//If the distance <1000m, count it before continuing
+				if ((MagSquared = VectorMagnitudeSquared(q)) < 1e6)
+				{
+					(*close)++;
+					MagSquared = 1e6;
+				}
+				
+				scalar = list[j].mu * InverseCube(MagSquared);
+				block_sum = VectorAdd(block_sum, VectorMult(q, scalar));
+			}
+		}
+		
+		//Join the block with every finished subtree of the same size, as in binary counting
+		blocks++;
+		for (unsigned long carry = blocks; (carry & 1) == 0; carry = carry >> 1)
+		{
+			depth--;
+			block_sum = VectorAdd(stack[depth], block_sum);
+		}
+		stack[depth] = block_sum;
+		depth++;
+	}
+	
+	//Join what remains, from the smallest subtree up
+	vector a_sum = stack[depth - 1];
+	for (int d = depth - 2; d >= 0; d--)
+	{
+		a_sum = VectorAdd(stack[d], a_sum);
+	}
+	return a_sum;
+}
+
+//Function to choose between the fast sum and the deterministic sum, which is used when an order is given
+vector Acceleration(body *list, const int *slot, vector position, int i, int n, int *close)
+{
+	return (slot == NULL) ? AccelerationSum(list, position, i, n, close) : AccelerationSumOrdered(list, slot, position, i, n, close);
+}
+
+//Function to advance one body by one RK step, against the positions of the others at the start of the step
+//Passing the input order in slot selects the deterministic sum
+void StepBody(body *list, const int *slot, int i, int n, vector *NewP, vector *NewV, int *close)
+{
+	//Set multipliers for RK method
+	double h = 1.0;
+	double half_h = h / 2.0;
+	double C = h / 6.0;
+	
+	//Initial position and initial velocity vectors
+	vector pi = list[i].p;
+	vector vi = list[i].v;
+	
+	vector K1V = Acceleration(list, slot, pi, i, n, close);
+	vector K1R = vi;
+	
+	vector K2V_pos = VectorAdd(pi, (VectorMult(K1R, half_h)));
+	vector K2V = Acceleration(list, slot, K2V_pos, i, n, close);
+	vector K2R = VectorAdd(vi, VectorMult(K1V, half_h));
+	
+	vector K3V_pos = VectorAdd(pi, (VectorMult(K2R, half_h)));
+	vector K3V = Acceleration(list, slot, K3V_pos, i, n, close);
+	vector K3R = VectorAdd(vi, VectorMult(K2V, half_h));
+	
+	vector K4V_pos = VectorAdd(pi, VectorMult(K3R, h));
+	vector K4V = Acceleration(list, slot, K4V_pos, i, n, close);
+	vector K4R = VectorAdd(vi, VectorMult(K3V, h));
+	
+	//Vector for sum of K coefficients
+	vector sum_k = VectorAdd(VectorAdd(K1V, VectorMult(K2V, 2.0)), VectorAdd(VectorMult(K3V, 2.0), K4V));
+	*NewV = VectorAdd(vi, VectorMult(sum_k, C));
+	
+	sum_k = VectorAdd(VectorAdd(K1R, VectorMult(K2R, 2.0)), VectorAdd(VectorMult(K3R, 2.0), K4R)); 
+	*NewP = VectorAdd(pi, VectorMult(sum_k, C));
+}
+
+
+//--------------------
+//Function Definitions
+//Small System Kernel Functions
+//--------------------
+
+//Net acceleration on body i of a small system held in local arrays
+//Always inlined into a kernel where n is a constant, so the loop is unrolled completely
+static inline __attribute__((always_inline)) vector SmallAcceleration(const vector *p, const double *mu, vector position, int i, const int n, int *close)
+{
+	vector a_sum = {0, 0, 0};
+	double MagSquared;
+	
+	_Pragma("GCC unroll 6")
+	for (int j = 0; j < n; j++)
+	{
+		if (i != j)
+		{
+			vector q = VectorSubtract(p[j], position);
+			
+			//If the distance <1000m, count it before continuing
+			if ((MagSquared = VectorMagnitudeSquared(q)) < 1e6)
+			{
+				(*close)++;
+				MagSquared = 1e6;
+			}
+			
+			a_sum = VectorAdd(a_sum, VectorMult(q, mu[j] * InverseCube(MagSquared)));
+		}
+	}
+	return a_sum;
+}
+
+//Steps a small system for a number of seconds with its state copied into local arrays
+//Does the same arithmetic in the same order as StepBody, so results match the general path bit for bit
+static inline __attribute__((always_inline)) void StepSmall(simulation *sim, unsigned long seconds, const int n)
+{
+	vector p[SMALL_MAX];
+	vector v[SMALL_MAX];
+	double mu[SMALL_MAX];
+	vector NewP[SMALL_MAX];
+	vector NewV[SMALL_MAX];
+	int close = 0;
+	
+	//Set multipliers for RK method
+	double h = 1.0;
+	double half_h = h / 2.0;
+	double C = h / 6.0;
+	
+	for (int i = 0; i < n; i++)
+	{
+		p[i] = sim->list[i].p;
+		v[i] = sim->list[i].v;
+		mu[i] = sim->list[i].mu;
+	}
+	
+	for (unsigned long s = 0; s < seconds; s++)
+	{
+		_Pragma("GCC unroll 6")
+		for (int i = 0; i < n; i++)
+		{
+			vector pi = p[i];
+			vector vi = v[i];
+			
+			vector K1V = SmallAcceleration(p, mu, pi, i, n, &close);
+			vector K1R = vi;
+			
+			vector K2V = SmallAcceleration(p, mu, VectorAdd(pi, (VectorMult(K1R, half_h))), i, n, &close);
+			vector K2R = VectorAdd(vi, VectorMult(K1V, half_h));
+			
+			vector K3V = SmallAcceleration(p, mu, VectorAdd(pi, (VectorMult(K2R, half_h))), i, n, &close);
+			vector K3R = VectorAdd(vi, VectorMult(K2V, half_h));
+			
+			vector K4V = SmallAcceleration(p, mu, VectorAdd(pi, VectorMult(K3R, h)), i, n, &close);
+			vector K4R = VectorAdd(vi, VectorMult(K3V, h));
+			
+			vector sum_k = VectorAdd(VectorAdd(K1V, VectorMult(K2V, 2.0)), VectorAdd(VectorMult(K3V, 2.0), K4V));
+			NewV[i] = VectorAdd(vi, VectorMult(sum_k, C));
+			
+			sum_k = VectorAdd(VectorAdd(K1R, VectorMult(K2R, 2.0)), VectorAdd(VectorMult(K3R, 2.0), K4R));
+			NewP[i] = VectorAdd(pi, VectorMult(sum_k, C));
+		}
+		
+		for (int i = 0; i < n; i++)
+		{
+			p[i] = NewP[i];
+			v[i] = NewV[i];
+		}
+	}
+	
+	for (int i = 0; i < n; i++)
+	{
+		sim->list[i].p = p[i];
+		sim->list[i].v = v[i];
+	}
+	sim->simtime += seconds;
+	sim->closeencounters += close;
+}
+
+//One kernel for each size of small system
+#define SMALL_KERNEL(N) static void StepSmall##N(simulation *sim, unsigned long seconds) { StepSmall(sim, seconds, N); }
+SMALL_KERNEL(2) SMALL_KERNEL(3) SMALL_KERNEL(4) SMALL_KERNEL(5) SMALL_KERNEL(6)
+
+//Kernel for each number of bodies, or NULL where the general path is used
+static void (*const SmallKernels[SMALL_MAX + 1])(simulation *, unsigned long) = {NULL, NULL,
+	StepSmall2, StepSmall3, StepSmall4, StepSmall5, StepSmall6};
+
+//Returns the kernel that can step a simulation, or NULL if it must take the general path
+//Kernels only run the fast sum, with every body integrated
+//They run on the calling thread even with a worker pool, since a step of a few bodies takes less time than a pass through the pool's barriers
+static void (*SmallKernel(const simulation *sim))(simulation *, unsigned long)
+{
+	if (!sim->specialized || sim->totalbodies > SMALL_MAX || sim->deterministic || sim->eph != NULL)
+	{
+		return NULL;
+	}
+	return SmallKernels[sim->totalbodies];
+}
+
+
+//--------------------
+//Function Definitions
+//Close Encounter Functions
+//--------------------
+
+//Finds the pairs of bodies that are, or before the next check could become, too close for the 1 second step
+//A pair qualifies when its straight-line closest approach over that time is within twice the distance where its dynamical time
+//sqrt(r^3 / G(m1 + m2)) is ENCOUNTER_TIMESCALE, and two bodies are paired only if each is the other's closest by that measure
+//The search for each body's closest is shared over the worker pool like a step
+int FindEncounters(simulation *sim)
+{
+	int n = sim->totalbodies;
+	
+	if (sim->threads > 1)
+	{
+		PartitionTasks(sim);
+		sim->searching = 1;
+		pthread_barrier_wait(&sim->synchronizer);
+		pthread_barrier_wait(&sim->synchronizer);
+		sim->searching = 0;
+	}
+	else
+	{
+		NearestPartners(sim, 0, n);
+	}
+	
+	//Keep only the pairs where each body chose the other
+	int pairs = 0;
+	for (int k = 0; k < n; k++)
+	{
+		int l = sim->partner[k];
+		if (l >= 0 && sim->partner[l] != k)
+		{
+			sim->partner[k] = -1;
+		}
+		else if (l > k)
+		{
+			pairs++;
+		}
+	}
+	return pairs;
+}
+
+//Finds the closest candidate partner of each body from list position first to last, by the measure above
+//The measure is the same both ways round and others are visited by input number, so no body's choice depends on the order of
+//the list or on how the search is split
+void NearestPartners(simulation *sim, int first, int last)
+{
+	int n = sim->totalbodies;
+	double *nearest = sim->scratch;
+	
+	for (int i = first; i < last; i++)
+	{
+		int k = sim->index[i];
+		sim->partner[k] = -1;
+		nearest[k] = 1.0;
+		
+		//Bodies driven by an ephemeris are never paired
+		if (sim->driven != NULL && sim->driven[k] >= 0)
+		{
+			continue;
+		}
+		body *a = &sim->list[i];
+		
+		for (int l = 0; l < n; l++)
+		{
+			if (l == k || (sim->driven != NULL && sim->driven[l] >= 0))
+			{
+				continue;
+			}
+			body *b = &sim->list[sim->slot[l]];
+			
+			//Closest approach in a straight line over the time until the next check
+			vector r = VectorSubtract(b->p, a->p);
+			vector v = VectorSubtract(b->v, a->v);
+			double rv = r.x * v.x + r.y * v.y + r.z * v.z;
+			if (rv < 0)
+			{
+				double t = -rv / VectorMagnitudeSquared(v);
+				r = VectorAdd(r, VectorMult(v, (t < ENCOUNTER_CHECK) ? t : ENCOUNTER_CHECK));
+			}
+			
+			//Distance to the sixth power over (2^3 T^2 G(m1 + m2))^2, which needs no roots and is below one for a close pair
+			double d2 = VectorMagnitudeSquared(r);
+			double limit = 8.0 * ENCOUNTER_TIMESCALE * ENCOUNTER_TIMESCALE * (a->mu + b->mu);
+			double measure = (d2 * d2 * d2) / (limit * limit);
+			
+			if (measure < nearest[k])
+			{
+				nearest[k] = measure;
+				sim->partner[k] = l;
+			}
+		}
+	}
+}
+
+//Function to find the pull of one body at a position
+vector SourcePull(const body *source, vector position, int *close)
+{
+	vector q = VectorSubtract(source->p, position);
+	double MagSquared = VectorMagnitudeSquared(q);
+	
+	//If the distance <1000m, count it before continuing
+	if (MagSquared < 1e6)
+	{
+		(*close)++;
+		MagSquared = 1e6;
+	}
+	return VectorMult(q, source->mu * InverseCube(MagSquared));
+}
+
+//Function to find the acceleration on both bodies of a close pair from every other body, in one pass over the list
+//Neither pulls on the other here; passing the input order in slot selects the same pairwise tree as the deterministic sum
+void PairAcceleration(body *list, const int *slot, int i, int j, vector pi, vector pj, int n, vector *ai, vector *aj, int *close)
+{
+	vector zero = {0, 0, 0};
+	
+	if (slot == NULL)
+	{
+		*ai = zero;
+		*aj = zero;
+		for (int k = 0; k < n; k++)
+		{
+			if (k != i && k != j)
+			{
+				*ai = VectorAdd(*ai, SourcePull(&list[k], pi, close));
+				*aj = VectorAdd(*aj, SourcePull(&list[k], pj, close));
+			}
+		}
+		return;
+	}
+	
+	//Partial sums waiting to be joined, one for each level of the tree, for each body
+	vector StackI[64];
+	vector StackJ[64];
+	int depth = 0;
+	unsigned long blocks = 0;
+	
+	for (int k = 0; k < n; k = k + PAIRWISE_BLOCK)
+	{
+		vector SumI = zero;
+		vector SumJ = zero;
+		int stop = (k + PAIRWISE_BLOCK < n) ? k + PAIRWISE_BLOCK : n;
+		
+		for (int m = k; m < stop; m++)
+		{
+			int l = slot[m];
+			if (l != i && l != j)
+			{
+				SumI = VectorAdd(SumI, SourcePull(&list[l], pi, close));
+				SumJ = VectorAdd(SumJ, SourcePull(&list[l], pj, close));
+			}
+		}
+		
+		blocks++;
+		for (unsigned long carry = blocks; (carry & 1) == 0; carry = carry >> 1)
+		{
+			depth--;
+			SumI = VectorAdd(StackI[depth], SumI);
+			SumJ = VectorAdd(StackJ[depth], SumJ);
+		}
+		StackI[depth] = SumI;
+		StackJ[depth] = SumJ;
+		depth++;
+	}
+	
+	*ai = StackI[depth - 1];
+	*aj = StackJ[depth - 1];
+	for (int d = depth - 2; d >= 0; d--)
+	{
+		*ai = VectorAdd(StackI[d], *ai);
+		*aj = VectorAdd(StackJ[d], *aj);
+	}
+}
+
+//Derivatives of the regularized state of a pair with respect to fictitious time s, where dt = r ds
+//Y holds the four KS coordinates u, their derivatives, the Kepler energy of the pair, and time
+void EncounterDerivatives(const double *Y, vector P, double *dY)
+{
+	const double *u = Y;
+	const double *w = Y + 4;
+	double r = u[0] * u[0] + u[1] * u[1] + u[2] * u[2] + u[3] * u[3];
+	
+	//The perturbing acceleration carried into KS space by the transpose of the KS matrix
+	double LP[4] = {
+		u[0] * P.x + u[1] * P.y + u[2] * P.z,
+		-u[1] * P.x + u[0] * P.y + u[3] * P.z,
+		-u[2] * P.x - u[3] * P.y + u[0] * P.z,
+		u[3] * P.x - u[2] * P.y + u[1] * P.z};
+	
+	double dh = 0;
+	for (int k = 0; k < 4; k++)
+	{
+		dY[k] = w[k];
+		dY[4 + k] = 0.5 * Y[8] * u[k] + 0.5 * r * LP[k];
+		dh = dh + w[k] * LP[k];
+	}
+	dY[8] = 2.0 * dh;
+	dY[9] = r;
+}
+
+//Advances the regularized state of a pair by ds in fictitious time, with one RK step
+void EncounterSubstep(double *Y, vector P, double ds)
+{
+	double K[4][10];
+	double T[10];
+	
+	EncounterDerivatives(Y, P, K[0]);
+	for (int k = 0; k < 10; k++)
+	{
+		T[k] = Y[k] + 0.5 * ds * K[0][k];
+	}
+	EncounterDerivatives(T, P, K[1]);
+	for (int k = 0; k < 10; k++)
+	{
+		T[k] = Y[k] + 0.5 * ds * K[1][k];
+	}
+	EncounterDerivatives(T, P, K[2]);
+	for (int k = 0; k < 10; k++)
+	{
+		T[k] = Y[k] + ds * K[2][k];
+	}
+	EncounterDerivatives(T, P, K[3]);
+	
+	for (int k = 0; k < 10; k++)
+	{
+		Y[k] = Y[k] + ds / 6.0 * (K[0][k] + 2.0 * K[1][k] + 2.0 * K[2][k] + K[3][k]);
+	}
+}
+
+//Advances the relative position and velocity of a pair by one second under their mutual pull and a fixed perturbation
+//In Kustaanheimo-Stiefel coordinates the motion is a smooth oscillator even through a close approach, so substeps can be
+//of fixed length in fictitious time, a set number to each orbit
+void EncounterStep(vector *r, vector *v, double mu, vector P)
+{
+	double R = sqrt(VectorMagnitudeSquared(*r));
+	double Y[10];
+	double *u = Y;
+	double *w = Y + 4;
+	
+	//Bodies on top of each other cannot be regularized, so only the perturbation moves them
+	if (R == 0)
+	{
+		*r = VectorAdd(*r, VectorAdd(*v, VectorMult(P, 0.5)));
+		*v = VectorAdd(*v, P);
+		return;
+	}
+	
+	//Choose the KS coordinates that avoid dividing by a small number
+	if (r->x >= 0)
+	{
+		u[0] = sqrt(0.5 * (R + r->x));
+		u[1] = r->y / (2.0 * u[0]);
+		u[2] = r->z / (2.0 * u[0]);
+		u[3] = 0;
+	}
+	else
+	{
+		u[1] = sqrt(0.5 * (R - r->x));
+		u[0] = r->y / (2.0 * u[1]);
+		u[3] = r->z / (2.0 * u[1]);
+		u[2] = 0;
+	}
+	w[0] = 0.5 * (u[0] * v->x + u[1] * v->y + u[2] * v->z);
+	w[1] = 0.5 * (-u[1] * v->x + u[0] * v->y + u[3] * v->z);
+	w[2] = 0.5 * (-u[2] * v->x - u[3] * v->y + u[0] * v->z);
+	w[3] = 0.5 * (u[3] * v->x - u[2] * v->y + u[1] * v->z);
+	Y[8] = 0.5 * VectorMagnitudeSquared(*v) - mu / R;
+	Y[9] = 0;
+	
+	//A set number of substeps to each orbit, and never more than about a second in one
+	double ds = 2.0 * M_PI / sqrt(0.5 * fabs(Y[8])) / ENCOUNTER_SUBSTEPS;
+	ds = (ds < 1.0 / R) ? ds : 1.0 / R;
+	
+	//Take whole substeps while more than one remains, then close in on the end of the second
+	double r_now = R;
+	while (1.0 - Y[9] > 1.5 * ds * r_now)
+	{
+		EncounterSubstep(Y, P, ds);
+		r_now = u[0] * u[0] + u[1] * u[1] + u[2] * u[2] + u[3] * u[3];
+	}
+	for (int k = 0; k < 4 && fabs(1.0 - Y[9]) > 1e-14; k++)
+	{
+		EncounterSubstep(Y, P, (1.0 - Y[9]) / r_now);
+		r_now = u[0] * u[0] + u[1] * u[1] + u[2] * u[2] + u[3] * u[3];
+	}
+	
+	//Back to position and velocity
+	r->x = u[0] * u[0] - u[1] * u[1] - u[2] * u[2] + u[3] * u[3];
+	r->y = 2.0 * (u[0] * u[1] - u[2] * u[3]);
+	r->z = 2.0 * (u[0] * u[2] + u[1] * u[3]);
+	v->x = 2.0 / r_now * (u[0] * w[0] - u[1] * w[1] - u[2] * w[2] + u[3] * w[3]);
+	v->y = 2.0 / r_now * (u[1] * w[0] + u[0] * w[1] - u[3] * w[2] - u[2] * w[3]);
+	v->z = 2.0 / r_now * (u[2] * w[0] + u[3] * w[1] + u[0] * w[2] + u[1] * w[3]);
+}
+
+//Steps the close pair holding the body at list position i by one second into the new position and velocity lists
+//The center of mass takes the same RK stages as StepBody, with both bodies carried along at their separation at the start of
+//the step and pulled by the others where each stage puts them; the relative motion is regularized under the mean tidal pull
+void StepPair(simulation *sim, int i, int *close)
+{
+	body *list = sim->list;
+	int j = sim->slot[sim->partner[sim->index[i]]];
+	int n = sim->totalbodies;
+	
+	//Set multipliers for RK method
+	double h = 1.0;
+	double half_h = h / 2.0;
+	double C = h / 6.0;
+	double offset[4] = {0, half_h, half_h, h};
+	double weight[4] = {1.0, 2.0, 2.0, 1.0};
+	
+	double mi = list[i].mu;
+	double mj = list[j].mu;
+	double M = mi + mj;
+	vector center = VectorDivideBy(VectorAdd(VectorMult(list[i].p, mi), VectorMult(list[j].p, mj)), M);
+	vector velocity = VectorDivideBy(VectorAdd(VectorMult(list[i].v, mi), VectorMult(list[j].v, mj)), M);
+	
+	vector KV = {0, 0, 0};
+	vector KR = velocity;
+	vector SumV = {0, 0, 0};
+	vector SumR = {0, 0, 0};
+	vector tide = {0, 0, 0};
+	
+	for (int s = 0; s < 4; s++)
+	{
+		//Each stage moves the center by the previous stage's velocity, and its velocity by the previous stage's pull
+		vector shift = VectorMult(KR, offset[s]);
+		KR = VectorAdd(velocity, VectorMult(KV, offset[s]));
+		
+		vector ai;
+		vector aj;
+		PairAcceleration(list, SimOrder(sim), i, j, VectorAdd(list[i].p, shift), VectorAdd(list[j].p, shift), n, &ai, &aj, close);
+		KV = VectorDivideBy(VectorAdd(VectorMult(ai, mi), VectorMult(aj, mj)), M);
+		
+		SumV = VectorAdd(SumV, VectorMult(KV, weight[s]));
+		SumR = VectorAdd(SumR, VectorMult(KR, weight[s]));
+		tide = VectorAdd(tide, VectorMult(VectorSubtract(aj, ai), weight[s]));
+	}
+	center = VectorAdd(center, VectorMult(SumR, C));
+	velocity = VectorAdd(velocity, VectorMult(SumV, C));
+	
+	vector r = VectorSubtract(list[j].p, list[i].p);
+	vector v = VectorSubtract(list[j].v, list[i].v);
+	EncounterStep(&r, &v, M, VectorMult(tide, C));
+	
+	sim->NewP[i] = VectorSubtract(center, VectorMult(r, mj / M));
+	sim->NewV[i] = VectorSubtract(velocity, VectorMult(v, mj / M));
+	sim->NewP[j] = VectorAdd(center, VectorMult(r, mi / M));
+	sim->NewV[j] = VectorAdd(velocity, VectorMult(v, mi / M));
+}
+
+
+//--------------------
+//Function Definitions
+//Library Functions
+//--------------------
+
+//Creates a simulation from a copy of n bodies, with masses in kg
+//A thread count of one steps on the calling thread; zero uses one thread per processor
+SimStatus SimCreate(simulation **handle, const body *bodies, int n, int threads)
+{
+	*handle = NULL;
+	
+	//The simulation requires at least two bodies
+	if (n < 2)
+	{
+		return SIM_INSUFFICIENT_OBJECTS;
+	}
+	
+	threads = (threads <= 0) ? WorkerCount(n) : ((threads < n) ? threads : n);
+	int tasks = (threads * TASKS_PER_THREAD < n) ? threads * TASKS_PER_THREAD : n;
+	
+	//Size everything the simulation will hold, so it can all come from one block
+	size_t TextSize = 0;
+	for (int i = 0; i < n; i++)
+	{
+		TextSize = TextSize + strlen((bodies[i].name != NULL) ? bodies[i].name : "") + 1;
+	}
+	size_t ScratchSize = sizeof(unsigned int) * NameSlots(n);
+	ScratchSize = (ScratchSize > sizeof(double) * n) ? ScratchSize : sizeof(double) * n;
+	ScratchSize = (ScratchSize > ReorderSize(n, threads)) ? ScratchSize : ReorderSize(n, threads);
+	
+	size_t size = Aligned(sizeof(simulation)) + Aligned(sizeof(body) * n) + 4 * Aligned(sizeof(int) * n)
+		+ Aligned(sizeof(vector) * n * 2) + Aligned(sizeof(double) * n) + Aligned(ScratchSize) + Aligned(TextSize);
+	if (threads > 1)
+	{
+		size = size + Aligned(sizeof(SimTask) * tasks) + Aligned(sizeof(TaskDeque) * threads)
+			+ Aligned(sizeof(pthread_t) * threads) + Aligned(sizeof(ThreadData) * threads);
+	}
+	
+	arena memory;
+	if (ArenaCreate(&memory, size) != SIM_OK)
+	{
+		return SIM_BAD_MALLOC;
+	}
+	
+	//The handle is the first piece of its own arena
+	simulation *sim = ArenaAlloc(&memory, sizeof(simulation));
+	sim->memory = memory;
+	
+	sim->totalbodies = n;
+	sim->specialized = 1;
+	sim->regularized = 1;
+	sim->threads = threads;
+	sim->list = ArenaAlloc(&sim->memory, sizeof(body) * n);
+	sim->index = ArenaAlloc(&sim->memory, sizeof(int) * n);
+	sim->slot = ArenaAlloc(&sim->memory, sizeof(int) * n);
+	sim->VectorSpace = ArenaAlloc(&sim->memory, sizeof(vector) * n * 2);
+	sim->cost = ArenaAlloc(&sim->memory, sizeof(double) * n);
+	sim->partner = ArenaAlloc(&sim->memory, sizeof(int) * n);
+	sim->scratch = ArenaAlloc(&sim->memory, ScratchSize);
+	char *text = ArenaAlloc(&sim->memory, TextSize);
+	
+	int InitCount = InitThreads(n, sim->threads);
+	InitData *parts = malloc(sizeof(InitData) * InitCount);
+	
+	if (parts == NULL)
+	{
+		SimDestroy(sim);
+		return SIM_BAD_MALLOC;
+	}
+	
+	//Define vector lists within allocated space using pointer arithmetic
+	sim->NewP = sim->VectorSpace + 0 * n;
+	sim->NewV = sim->VectorSpace + 1 * n;
+	
+	//No body starts in a close pair
+	for (int k = 0; k < n; k++)
+	{
+		sim->partner[k] = -1;
+	}
+	
+	//Copy the bodies in input order, keeping each mass and G times it
+	SplitChunks(parts, InitCount, n);
+	for (int t = 0; t < InitCount; t++)
+	{
+		parts[t].list = sim->list;
+		parts[t].source = bodies;
+		parts[t].index = sim->index;
+		parts[t].slot = sim->slot;
+		parts[t].cost = sim->cost;
+	}
+	
+	SimStatus status = RunParallel(CopyThread, parts, sizeof(InitData), InitCount);
+	
+	//No body may have a negative mass
+	for (int t = 0; t < InitCount && status == SIM_OK; t++)
+	{
+		if (parts[t].invalid)
+		{
+			status = SIM_INVALID_MASS;
+		}
+	}
+	free(parts);
+	
+	if (status != SIM_OK)
+	{
+		SimDestroy(sim);
+		return status;
+	}
+	
+	//Give the simulation its own copy of each name, through a hash held in the scratch space
+	NameTable names;
+	NameTableInit(&names, text, sim->scratch, n);
+	for (int i = 0; i < n; i++)
+	{
+		sim->list[i].name = NameIntern(&names, bodies[i].name);
+	}
+	
+	//Start the worker pool if the step is to be shared
+	if (sim->threads > 1)
+	{
+		status = StartWorkers(sim);
+		if (status != SIM_OK)
+		{
+			SimDestroy(sim);
+			return status;
+		}
+	}
+	
+	*handle = sim;
+	return SIM_OK;
+}
+
+//Advances the simulation by a number of one-second steps
+SimStatus SimStep(simulation *sim, unsigned long seconds)
+{
+	int n = sim->totalbodies;
+	void (*kernel)(simulation *, unsigned long) = SmallKernel(sim);
+	
+	for (unsigned long s = 0; s < seconds; s++)
+	{
+		//Periodically sort the list so neighbouring bodies stay close in memory
+		//Costs are kept by input number, so they follow their bodies
+		if (sim->simtime % REORDER_INTERVAL == 0)
+		{
+			SimStatus status = SpatialReorder(sim->list, sim->index, n, sim->threads, sim->scratch);
+			if (status != SIM_OK)
+			{
+				return status;
+			}
+			
+			//Keep the way back from input number to list position
+			for (int i = 0; i < n; i++)
+			{
+				sim->slot[sim->index[i]] = i;
+			}
+		}
+		
+		//Look for bodies too close to be stepped with the rest
+		if (sim->regularized && sim->simtime % ENCOUNTER_CHECK == 0)
+		{
+			sim->pairs = FindEncounters(sim);
+		}
+		
+		//Small systems with no close pair run on their kernel until the next check, or the end of the call
+		if (kernel != NULL && sim->pairs == 0)
+		{
+			unsigned long run = ENCOUNTER_CHECK - sim->simtime % ENCOUNTER_CHECK;
+			run = (run < seconds - s) ? run : seconds - s;
+			kernel(sim, run);
+			s = s + run - 1;
+			continue;
+		}
+		
+		if (sim->threads > 1)
+		{
+			//Split this step's work using the costs measured so far
+			PartitionTasks(sim);
+			
+			//Release the workers, then wait for them to compute new vectors
+			pthread_barrier_wait(&sim->synchronizer);
+			pthread_barrier_wait(&sim->synchronizer);
+			
+			for (int t = 0; t < sim->totaltasks; t++)
+			{
+				sim->closeencounters += sim->tasks[t].close;
+			}
+		}
+		else
+		{
+			int close = 0;
+			for (int i = 0; i < n; i++)
+			{
+				//Bodies driven by an ephemeris are not integrated, and a close pair is stepped once, from its lower input number
+				int k = sim->index[i];
+				if (sim->driven != NULL && sim->driven[k] >= 0)
+				{
+					continue;
+				}
+				if (sim->partner[k] >= 0)
+				{
+					if (sim->partner[k] > k)
+					{
+						StepPair(sim, i, &close);
+					}
+					continue;
+				}
+				StepBody(sim->list, SimOrder(sim), i, n, &sim->NewP[i], &sim->NewV[i], &close);
+			}
+			sim->closeencounters += close;
+		}
+		
+		//Look up where bodies driven by an ephemeris are at the end of the step
+		if (sim->eph != NULL)
+		{
+			SimStatus status = SetDriven(sim, sim->simtime + 1, sim->NewP, sim->NewV);
+			if (status != SIM_OK)
+			{
+				return status;
+			}
+		}
+		
+		//For each object in the list, update positions and velocities
+		for (int i = 0; i < n; i++)
+		{
+			sim->list[i].p = sim->NewP[i];
+			sim->list[i].v = sim->NewV[i];
+		}
+		sim->simtime++;
+	}
+	return SIM_OK;
+}
+
+//Returns the state buffer, which stays valid until the next step
+//Bodies may be reordered in space, and each body holds G times its mass alongside its mass
+const body* SimState(const simulation *sim)
+{
+	return sim->list;
+}
+
+//Returns the input number of each body in the state buffer
+const int* SimIndex(const simulation *sim)
+{
+	return sim->index;
+}
+
+//Returns the number of seconds simulated so far
+unsigned long SimTime(const simulation *sim)
+{
+	return sim->simtime;
+}
+
+//Returns how many times bodies came within 1000 m of each other
+unsigned long SimCloseEncounters(const simulation *sim)
+{
+	return sim->closeencounters;
+}
+
+//Switches deterministic mode on or off
+//In deterministic mode, results are the same bit for bit on any number of threads and whatever the order of the list
+void SimSetDeterministic(simulation *sim, int on)
+{
+	sim->deterministic = on;
+}
+
+//Returns the bytes of memory taken by the simulation's state, all of it in one block
+size_t SimMemory(const simulation *sim)
+{
+	return sim->memory.size;
+}
+
+//Switches the kernels specialized for small systems on or off
+//They are on by default, and are only used where they give the same results as the general path
+void SimSetSpecialized(simulation *sim, int on)
+{
+	sim->specialized = on;
+}
+
+//Switches the regularized stepping of close pairs on or off
+//It is on by default; switched off, bodies in a pair go back to the main step at once
+void SimSetRegularized(simulation *sim, int on)
+{
+	sim->regularized = on;
+	if (!on)
+	{
+		for (int k = 0; k < sim->totalbodies; k++)
+		{
+			sim->partner[k] = -1;
+		}
+		sim->pairs = 0;
+	}
+}
+
+//Sets where the origin of the simulation's coordinates was at time zero, and its velocity, in the frame of the input
+//SetRelative returns both; ephemeris files record them so that a run in another frame can use the file
+void SimSetFrame(simulation *sim, vector origin, vector drift)
+{
+	sim->origin = origin;
+	sim->drift = drift;
+}
+
+//Returns the list position of each body by input number in deterministic mode, or NULL for the fast sum
+static const int* SimOrder(const simulation *sim)
+{
+	return sim->deterministic ? sim->slot : NULL;
+}
+
+//Returns the number of bodies in the simulation
+int SimBodies(const simulation *sim)
+{
+	return sim->totalbodies;
+}
+
+//Returns the position in the state buffer of each body by input number
+const int* SimSlot(const simulation *sim)
+{
+	return sim->slot;
+}
+
+//Returns whether the simulation's memory is on huge pages
+int SimHugePages(const simulation *sim)
+{
+	return sim->memory.huge;
+}
+
+//Returns whether steps are taken by a kernel specialized for the size of the system
+int SimSpecialized(const simulation *sim)
+{
+	return SmallKernel(sim) != NULL;
+}
+
+//Drives every body named in an ephemeris by that ephemeris instead of integrating it
+//The ephemeris must stay in memory for the life of the simulation, and the number of bodies matched is returned in matched
+//The number of those whose input position or velocity is not where the ephemeris puts them now is returned in moved
+SimStatus SimUseEphemeris(simulation *sim, const ephemeris *eph, int *matched, int *moved)
+{
+	int n = sim->totalbodies;
+	*matched = 0;
+	*moved = 0;
+	
+	if (sim->driven == NULL)
+	{
+		sim->driven = ArenaAlloc(&sim->memory, sizeof(int) * n);
+		
+		if (sim->driven == NULL)
+		{
+			return SIM_BAD_MALLOC;
+		}
+	}
+	
+	for (int k = 0; k < n; k++)
+	{
+		sim->driven[k] = -1;
+		for (int b = 0; b < eph->header.totalbodies; b++)
+		{
+			if (strcmp(sim->list[sim->slot[k]].name, eph->names[b]) == 0)
+			{
+				sim->driven[k] = b;
+				(*matched)++;
+				break;
+			}
+		}
+	}
+	
+	//Find the driven bodies' states into the step space first, so they can be compared with the input
+	sim->eph = eph;
+	SimStatus status = SetDriven(sim, sim->simtime, sim->NewP, sim->NewV);
+	if (status != SIM_OK)
+	{
+		return status;
+	}
+	
+	//Then move them onto the ephemeris
+	for (int i = 0; i < n; i++)
+	{
+		if (sim->driven[sim->index[i]] < 0)
+		{
+			continue;
+		}
+		
+		double distance = VectorMagnitudeSquared(VectorSubtract(sim->NewP[i], sim->list[i].p));
+		double speed = VectorMagnitudeSquared(VectorSubtract(sim->NewV[i], sim->list[i].v));
+		if (!(distance <= EPHEMERIS_TOLERANCE * EPHEMERIS_TOLERANCE) || !(speed <= EPHEMERIS_SPEED_TOLERANCE * EPHEMERIS_SPEED_TOLERANCE))
+		{
+			(*moved)++;
+		}
+		sim->list[i].p = sim->NewP[i];
+		sim->list[i].v = sim->NewV[i];
+	}
+	return SIM_OK;
+}
+
+//Sets the position and velocity of each driven body at time t, into the given lists or otherwise into the state
+SimStatus SetDriven(simulation *sim, unsigned long t, vector *NewP, vector *NewV)
+{
+	vector shift = VectorSubtract(sim->eph->header.origin, sim->origin);
+	vector drift = VectorSubtract(sim->eph->header.drift, sim->drift);
+	
+	for (int i = 0; i < sim->totalbodies; i++)
+	{
+		int b = sim->driven[sim->index[i]];
+		if (b < 0)
+		{
+			continue;
+		}
+		
+		vector *p = (NewP != NULL) ? &NewP[i] : &sim->list[i].p;
+		vector *v = (NewV != NULL) ? &NewV[i] : &sim->list[i].v;
+		SimStatus status = EphemerisState(sim->eph, b, (double) t, p, v);
+		if (status != SIM_OK)
+		{
+			return status;
+		}
+		
+		//Move from the frame the ephemeris was recorded in to the simulation's own
+		*p = VectorAdd(*p, VectorAdd(shift, VectorMult(drift, (double) t)));
+		*v = VectorAdd(*v, drift);
+	}
+	return SIM_OK;
+}
+
+//Stops any worker threads and frees all space held by a simulation
+void SimDestroy(simulation *sim)
+{
+	if (sim == NULL)
+	{
+		return;
+	}
+	
+	//Set simulation condition to end, then release the workers so they see it
+	if (sim->launched == 1)
+	{
+		sim->running = 0;
+		pthread_barrier_wait(&sim->synchronizer);
+		
+		for (int w = 0; w < sim->threads; w++)
+		{
+			pthread_join(sim->ThreadArray[w], NULL);
+			pthread_mutex_destroy(&sim->deques[w].lock);
+		}
+		
+		pthread_barrier_destroy(&sim->synchronizer);
+		pthread_cond_destroy(&sim->LaunchSignal);
+		pthread_mutex_destroy(&sim->LaunchLock);
+	}
+	
+	//The handle lives in the arena it frees
+	arena memory = sim->memory;
+	ArenaFree(&memory);
+}
+
+
+//--------------------
+//Function Definitions
+//Ephemeris Functions
+//--------------------
+
+//Fills terms with the Chebyshev polynomials T0 to Tdegree at tau
+//If slopes is not NULL, also fills it with the derivative of each polynomial
+void ChebyshevTerms(double tau, double *terms, double *slopes)
+{
+	//The second kind U(k-1) gives the derivative of T(k) as k U(k-1)
+	double U_previous = 0;
+	double U_current = 1;
+	
+	terms[0] = 1;
+	terms[1] = tau;
+	for (int k = 2; k <= EPHEMERIS_DEGREE; k++)
+	{
+		terms[k] = 2 * tau * terms[k - 1] - terms[k - 2];
+	}
+	
+	if (slopes == NULL)
+	{
+		return;
+	}
+	
+	slopes[0] = 0;
+	for (int k = 1; k <= EPHEMERIS_DEGREE; k++)
+	{
+		slopes[k] = k * U_current;
+		double U_next = 2 * tau * U_current - U_previous;
+		U_previous = U_current;
+		U_current = U_next;
+	}
+}
+
+//Starts recording the bodies named in a comma-separated list into an ephemeris file
+//Positions are sampled from the simulation now, and then each time EphemerisRecord is called, which must be every 60 seconds
+SimStatus EphemerisRecordStart(recorder *rec, const char *path, const simulation *sim, const char *names)
+{
+	int terms = EPHEMERIS_DEGREE + 1;
+	int n = sim->totalbodies;
+	
+	*rec = (recorder) {.file = NULL};
+	rec->bodies = malloc(sizeof(int) * n);
+	rec->basis = malloc(sizeof(double) * EPHEMERIS_SAMPLES * terms);
+	rec->fit = malloc(sizeof(double) * terms * terms);
+	
+	if (rec->bodies == NULL || rec->basis == NULL || rec->fit == NULL)
+	{
+		EphemerisRecordFinish(rec);
+		return SIM_BAD_MALLOC;
+	}
+	
+	//Find each named body, by input number
+	for (int k = 0; k < n; k++)
+	{
+		const char *name = sim->list[sim->slot[k]].name;
+		size_t length = strlen(name);
+		
+		const char *c = names;
+		while (c != NULL)
+		{
+			if (strncmp(c, name, length) == 0 && (c[length] == ',' || c[length] == '\0'))
+			{
+				rec->bodies[rec->count++] = k;
+				break;
+			}
+			
+			//Move on to the name after the next comma
+			c = strchr(c, ',');
+			c = (c != NULL) ? c + 1 : NULL;
+		}
+	}
+	
+	rec->sample = malloc(sizeof(vector) * EPHEMERIS_SAMPLES * (rec->count + 1));
+	rec->coeff = malloc(sizeof(double) * 3 * terms * (rec->count + 1));
+	
+	if (rec->sample == NULL || rec->coeff == NULL)
+	{
+		EphemerisRecordFinish(rec);
+		return SIM_BAD_MALLOC;
+	}
+	
+	rec->file = fopen(path, "w+b");
+	if (rec->file == NULL)
+	{
+		EphemerisRecordFinish(rec);
+		return SIM_FILE_ERROR;
+	}
+	
+	//The header is written again with the number of segments once recording is finished
+	EphemerisHeader header = {.magic = EPHEMERIS_MAGIC, .totalbodies = rec->count, .degree = EPHEMERIS_DEGREE,
+		.segments = 0, .start = sim->simtime, .span = EPHEMERIS_SPAN, .origin = sim->origin, .drift = sim->drift};
+	fwrite(&header, sizeof(header), 1, rec->file);
+	for (int b = 0; b < rec->count; b++)
+	{
+		char name[96] = {0};
+		strncpy(name, sim->list[sim->slot[rec->bodies[b]]].name, sizeof(name) - 1);
+		fwrite(name, sizeof(name), 1, rec->file);
+	}
+	
+	//Every segment is sampled at the same points, so the normal equations of the fit are set up once
+	for (int k = 0; k < EPHEMERIS_SAMPLES; k++)
+	{
+		ChebyshevTerms(2.0 * k / (EPHEMERIS_SAMPLES - 1) - 1.0, &rec->basis[k * terms], NULL);
+	}
+	for (int a = 0; a < terms; a++)
+	{
+		for (int b = 0; b < terms; b++)
+		{
+			double sum = 0;
+			for (int k = 0; k < EPHEMERIS_SAMPLES; k++)
+			{
+				sum += rec->basis[k * terms + a] * rec->basis[k * terms + b];
+			}
+			rec->fit[a * terms + b] = sum;
+		}
+	}
+	
+	//Then factored into L times L transposed, keeping L in the lower triangle
+	for (int a = 0; a < terms; a++)
+	{
+		for (int b = 0; b <= a; b++)
+		{
+			double sum = rec->fit[a * terms + b];
+			for (int k = 0; k < b; k++)
+			{
+				sum -= rec->fit[a * terms + k] * rec->fit[b * terms + k];
+			}
+			rec->fit[a * terms + b] = (a == b) ? sqrt(sum) : sum / rec->fit[b * terms + b];
+		}
+	}
+	
+	EphemerisRecord(rec, sim);
+	return SIM_OK;
+}
+
+//Samples the recorded bodies, writing a segment of coefficients to file each time a segment is complete
+void EphemerisRecord(recorder *rec, const simulation *sim)
+{
+	int terms = EPHEMERIS_DEGREE + 1;
+	
+	for (int b = 0; b < rec->count; b++)
+	{
+		rec->sample[b * EPHEMERIS_SAMPLES + rec->samples] = sim->list[sim->slot[rec->bodies[b]]].p;
+	}
+	rec->samples++;
+	
+	if (rec->samples < EPHEMERIS_SAMPLES)
+	{
+		return;
+	}
+	
+	//Fit each coordinate of each body by least squares
+	for (int b = 0; b < rec->count; b++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			double *c = &rec->coeff[(b * 3 + axis) * terms];
+			
+			//Right-hand side, then forward and back substitution through the factor
+			for (int a = 0; a < terms; a++)
+			{
+				double sum = 0;
+				for (int k = 0; k < EPHEMERIS_SAMPLES; k++)
+				{
+					vector p = rec->sample[b * EPHEMERIS_SAMPLES + k];
+					sum += rec->basis[k * terms + a] * ((axis == 0) ? p.x : (axis == 1) ? p.y : p.z);
+				}
+				c[a] = sum;
+			}
+			for (int a = 0; a < terms; a++)
+			{
+				for (int k = 0; k < a; k++)
+				{
+					c[a] -= rec->fit[a * terms + k] * c[k];
+				}
+				c[a] = c[a] / rec->fit[a * terms + a];
+			}
+			for (int a = terms - 1; a >= 0; a--)
+			{
+				for (int k = a + 1; k < terms; k++)
+				{
+					c[a] -= rec->fit[k * terms + a] * c[k];
+				}
+				c[a] = c[a] / rec->fit[a * terms + a];
+			}
+		}
+		
+		//The last sample of this segment is the first of the next
+		rec->sample[b * EPHEMERIS_SAMPLES] = rec->sample[b * EPHEMERIS_SAMPLES + EPHEMERIS_SAMPLES - 1];
+	}
+	
+	fwrite(rec->coeff, sizeof(double) * 3 * terms, rec->count, rec->file);
+	rec->segments++;
+	rec->samples = 1;
+}
+
+//Completes the ephemeris file and frees the recorder
+//Samples after the last complete segment are not kept
+void EphemerisRecordFinish(recorder *rec)
+{
+	if (rec->file != NULL)
+	{
+		EphemerisHeader header;
+		rewind(rec->file);
+		fread(&header, sizeof(header), 1, rec->file);
+		header.segments = rec->segments;
+		rewind(rec->file);
+		fwrite(&header, sizeof(header), 1, rec->file);
+		fclose(rec->file);
+	}
+	
+	free(rec->coeff);
+	free(rec->sample);
+	free(rec->fit);
+	free(rec->basis);
+	free(rec->bodies);
+}
+
+//Reads an ephemeris file into memory
+//The header is checked against the length of the file before anything is allocated
+SimStatus EphemerisLoad(ephemeris *eph, const char *path)
+{
+	*eph = (ephemeris) {.names = NULL, .coeff = NULL};
+	
+	FILE *in = fopen(path, "rb");
+	if (in == NULL)
+	{
+		return SIM_FILE_ERROR;
+	}
+	
+	struct stat info;
+	EphemerisHeader *header = &eph->header;
+	if (fstat(fileno(in), &info) != 0 || fread(header, sizeof(*header), 1, in) != 1 || header->magic != EPHEMERIS_MAGIC
+		|| header->degree != EPHEMERIS_DEGREE || header->totalbodies < 1 || header->segments < 1
+		|| !(header->span > 0) || !isfinite(header->span) || !isfinite(header->start)
+		|| !isfinite(header->origin.x) || !isfinite(header->origin.y) || !isfinite(header->origin.z)
+		|| !isfinite(header->drift.x) || !isfinite(header->drift.y) || !isfinite(header->drift.z))
+	{
+		fclose(in);
+		return SIM_FILE_ERROR;
+	}
+	
+	//The names and then whole segments must fill the rest of the file exactly
+	//Dividing what is left, instead of multiplying out the header, keeps a corrupt count from overflowing
+	size_t count = header->totalbodies;
+	size_t segment = sizeof(double) * count * 3 * (EPHEMERIS_DEGREE + 1);
+	size_t size = (size_t) info.st_size;
+	if (size < sizeof(*header) || (size - sizeof(*header)) / sizeof(eph->names[0]) < count)
+	{
+		fclose(in);
+		return SIM_FILE_ERROR;
+	}
+	
+	size_t left = size - sizeof(*header) - sizeof(eph->names[0]) * count;
+	if (left % segment != 0 || left / segment != header->segments)
+	{
+		fclose(in);
+		return SIM_FILE_ERROR;
+	}
+	
+	size_t values = left / sizeof(double);
+	eph->names = malloc(sizeof(eph->names[0]) * count);
+	eph->coeff = malloc(left);
+	
+	if (eph->names == NULL || eph->coeff == NULL)
+	{
+		fclose(in);
+		EphemerisFree(eph);
+		return SIM_BAD_MALLOC;
+	}
+	
+	if (fread(eph->names, sizeof(eph->names[0]), count, in) != count || fread(eph->coeff, sizeof(double), values, in) != values)
+	{
+		fclose(in);
+		EphemerisFree(eph);
+		return SIM_FILE_ERROR;
+	}
+	
+	//Names are compared as strings, so each must end inside its field
+	for (size_t b = 0; b < count; b++)
+	{
+		eph->names[b][sizeof(eph->names[0]) - 1] = '\0';
+	}
+	
+	fclose(in);
+	return SIM_OK;
+}
+
+//Finds the position and velocity of ephemeris body b at simulated time t
+//Returns SIM_EPHEMERIS_RANGE if t is not covered by the file
+SimStatus EphemerisState(const ephemeris *eph, int b, double t, vector *p, vector *v)
+{
+	int terms = EPHEMERIS_DEGREE + 1;
+	double span = eph->header.span;
+	double since = t - eph->header.start;
+	
+	if (since < 0 || since > span * eph->header.segments)
+	{
+		return SIM_EPHEMERIS_RANGE;
+	}
+	
+	//The end of the last segment belongs to that segment
+	unsigned long segment = (unsigned long) (since / span);
+	if (segment == eph->header.segments)
+	{
+		segment--;
+	}
+	
+	double T[EPHEMERIS_DEGREE + 1];
+	double dT[EPHEMERIS_DEGREE + 1];
+	ChebyshevTerms(2.0 * (since - segment * span) / span - 1.0, T, dT);
+	
+	const double *c = &eph->coeff[(segment * eph->header.totalbodies + b) * 3 * terms];
+	double position[3] = {0, 0, 0};
+	double velocity[3] = {0, 0, 0};
+	
+	for (int axis = 0; axis < 3; axis++)
+	{
+		for (int k = terms - 1; k >= 0; k--)
+		{
+			position[axis] += c[axis * terms + k] * T[k];
+			velocity[axis] += c[axis * terms + k] * dT[k];
+		}
+	}
+	
+	//Scale the slope from the segment's range of -1 to 1 back into seconds
+	*p = (vector) {position[0], position[1], position[2]};
+	*v = VectorMult((vector) {velocity[0], velocity[1], velocity[2]}, 2.0 / span);
+	return SIM_OK;
+}
+
+//Frees an ephemeris read into memory
+void EphemerisFree(ephemeris *eph)
+{
+	free(eph->coeff);
+	free(eph->names);
+}
+
+
+//--------------------
+//Function Definitions
+//Frame Stream Functions
+//--------------------
+
+//Returns the number of bytes held by one frame slot, rounded up to whole cache lines
+size_t StreamFrameSize(int n)
+{
+	size_t size = sizeof(StreamFrame) + sizeof(vector) * n;
+	return (size + 63) / 64 * 64;
+}
+
+//Creates a ring of frames in a file mapped into memory, holding capacity frames of n bodies
+//Names are taken from the bodies in input order
+SimStatus StreamCreate(stream *out, const char *path, const body *bodies, int n, unsigned long capacity)
+{
+	size_t NameOffset = (sizeof(StreamHeader) + 63) / 64 * 64;
+	size_t FrameOffset = (NameOffset + sizeof(out->names[0]) * n + 63) / 64 * 64;
+	size_t framesize = StreamFrameSize(n);
+	size_t size = FrameOffset + framesize * capacity;
+	
+	if (capacity == 0)
+	{
+		return SIM_FILE_ERROR;
+	}
+	
+	out->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (out->fd == -1)
+	{
+		return SIM_FILE_ERROR;
+	}
+	
+	//Size the file to the whole ring, then map it
+	if (ftruncate(out->fd, (off_t) size) != 0)
+	{
+		close(out->fd);
+		return SIM_FILE_ERROR;
+	}
+	
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(out->fd);
+		return SIM_FILE_ERROR;
+	}
+	
+	out->size = size;
+	out->header = map;
+	out->names = (char (*)[96]) ((char*) map + NameOffset);
+	out->frames = (unsigned char*) map + FrameOffset;
+	
+	for (int i = 0; i < n; i++)
+	{
+		strncpy(out->names[i], bodies[i].name, sizeof(out->names[i]) - 1);
+	}
+	
+	out->header->totalbodies = n;
+	out->header->capacity = capacity;
+	out->header->framesize = framesize;
+	out->header->NameOffset = NameOffset;
+	out->header->FrameOffset = FrameOffset;
+	atomic_store_explicit(&out->header->sequence, 0, memory_order_relaxed);
+	
+	//The magic number is written last, so a reader never sees a half-made header
+	atomic_thread_fence(memory_order_release);
+	out->header->magic = STREAM_MAGIC;
+	return SIM_OK;
+}
+
+//Writes the current positions of a simulation into the next slot of the ring, in input order
+void StreamPush(stream *out, const simulation *sim)
+{
+	const body *list = SimState(sim);
+	const int *index = SimIndex(sim);
+	int n = out->header->totalbodies;
+	
+	unsigned long sequence = atomic_load_explicit(&out->header->sequence, memory_order_relaxed);
+	StreamFrame *frame = (StreamFrame*) (out->frames + (sequence % out->header->capacity) * out->header->framesize);
+	
+	//Mark the slot as being written before touching its contents
+	atomic_store_explicit(&frame->sequence, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	
+	frame->simtime = SimTime(sim);
+	for (int k = 0; k < n; k++)
+	{
+		frame->p[index[k]] = list[k].p;
+	}
+	
+	//Then publish the slot, and the frame count after it
+	atomic_store_explicit(&frame->sequence, sequence + 1, memory_order_release);
+	atomic_store_explicit(&out->header->sequence, sequence + 1, memory_order_release);
+}
+
+//Maps an existing ring for reading
+SimStatus StreamOpen(stream *in, const char *path)
+{
+	struct stat info;
+	
+	in->fd = open(path, O_RDONLY);
+	if (in->fd == -1)
+	{
+		return SIM_FILE_ERROR;
+	}
+	
+	if (fstat(in->fd, &info) != 0 || (size_t) info.st_size < sizeof(StreamHeader))
+	{
+		close(in->fd);
+		return SIM_FILE_ERROR;
+	}
+	
+	void *map = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, in->fd, 0);
+	if (map == MAP_FAILED)
+	{
+		close(in->fd);
+		return SIM_FILE_ERROR;
+	}
+	
+	in->size = (size_t) info.st_size;
+	in->header = map;
+	
+	if (in->header->magic != STREAM_MAGIC)
+	{
+		StreamClose(in);
+		return SIM_FILE_ERROR;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	
+	//A truncated or foreign file must not lead reads past the end of the mapping
+	//Each check is made so that no sum or product can overflow
+	const StreamHeader *h = in->header;
+	size_t size = in->size;
+	if (h->totalbodies < 1 || h->capacity < 1 || h->framesize != StreamFrameSize(h->totalbodies)
+		|| h->NameOffset < sizeof(StreamHeader) || h->NameOffset > size
+		|| (size - h->NameOffset) / sizeof(in->names[0]) < (size_t) h->totalbodies
+		|| h->FrameOffset < h->NameOffset + sizeof(in->names[0]) * h->totalbodies || h->FrameOffset > size
+		|| (size - h->FrameOffset) / h->framesize < h->capacity)
+	{
+		StreamClose(in);
+		return SIM_FILE_ERROR;
+	}
+	
+	in->names = (char (*)[96]) ((char*) map + in->header->NameOffset);
+	in->frames = (unsigned char*) map + in->header->FrameOffset;
+	return SIM_OK;
+}
+
+//Returns the newest frame in place, or NULL if none has been written yet
+//The frame must be checked with StreamFrameValid after it has been read
+const StreamFrame* StreamLatest(const stream *in, unsigned long *sequence)
+{
+	*sequence = atomic_load_explicit(&in->header->sequence, memory_order_acquire);
+	if (*sequence == 0)
+	{
+		return NULL;
+	}
+	
+	const StreamFrame *frame = (const StreamFrame*) (in->frames + ((*sequence - 1) % in->header->capacity) * in->header->framesize);
+	if (atomic_load_explicit(&frame->sequence, memory_order_acquire) != *sequence)
+	{
+		return NULL;
+	}
+	return frame;
+}
+
+//Returns true if a frame read in place was not overwritten while it was being read
+int StreamFrameValid(const StreamFrame *frame, unsigned long sequence)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&frame->sequence, memory_order_relaxed) == sequence;
+}
+
+//Unmaps a ring
+void StreamClose(stream *s)
+{
+	munmap(s->header, s->size);
+	close(s->fd);
+}
+
+
+//--------------------
+//Function Definitions
+//Work Scheduling Functions
+//--------------------
+
+//Returns the number of worker threads used for a list of n bodies
+int WorkerCount(int n)
+{
+	int threads = CountProcessors();
+	return (threads < n) ? threads : n;
+}
+
+//Creates the worker pool
+//Workers hold at a gate until all of them exist, so a failed start can be undone
+SimStatus StartWorkers(simulation *sim)
+{
+	int threads = sim->threads;
+	sim->totaltasks = (threads * TASKS_PER_THREAD < sim->totalbodies) ? threads * TASKS_PER_THREAD : sim->totalbodies;
+	sim->tasks = ArenaAlloc(&sim->memory, sizeof(SimTask) * sim->totaltasks);
+	sim->deques = ArenaAlloc(&sim->memory, sizeof(TaskDeque) * threads);
+	sim->ThreadArray = ArenaAlloc(&sim->memory, sizeof(pthread_t) * threads);
+	sim->ThreadArg = ArenaAlloc(&sim->memory, sizeof(ThreadData) * threads);
+	
+	if (sim->tasks == NULL || sim->deques == NULL || sim->ThreadArray == NULL || sim->ThreadArg == NULL)
+	{
+		return SIM_BAD_MALLOC;
+	}
+	
+	//Total threads is the number of workers, plus one for the thread stepping the simulation
+	pthread_barrier_init(&sim->synchronizer, NULL, threads + 1);
+	pthread_mutex_init(&sim->LaunchLock, NULL);
+	pthread_cond_init(&sim->LaunchSignal, NULL);
+	
+	//Workers need little stack, which adds up with many of them
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, WORKER_STACK);
+	
+	int started = 0;
+	while (started < threads)
+	{
+		pthread_mutex_init(&sim->deques[started].lock, NULL);
+		sim->deques[started].top = 0;
+		sim->deques[started].bottom = 0;
+		
+		sim->ThreadArg[started].sim = sim;
+		sim->ThreadArg[started].num = started;
+		
+		if (pthread_create(&sim->ThreadArray[started], &attr, SimThread, (void*) &sim->ThreadArg[started]) != 0)
+		{
+			pthread_mutex_destroy(&sim->deques[started].lock);
+			break;
+		}
+		started++;
+	}
+	pthread_attr_destroy(&attr);
+	
+	//Open the gate, either to run or, if a worker could not be created, to return at once
+	pthread_mutex_lock(&sim->LaunchLock);
+	sim->running = 1;
+	sim->launched = (started == threads) ? 1 : -1;
+	pthread_cond_broadcast(&sim->LaunchSignal);
+	pthread_mutex_unlock(&sim->LaunchLock);
+	
+	if (started == threads)
+	{
+		return SIM_OK;
+	}
+	
+	for (int w = 0; w < started; w++)
+	{
+		pthread_join(sim->ThreadArray[w], NULL);
+		pthread_mutex_destroy(&sim->deques[w].lock);
+	}
+	pthread_barrier_destroy(&sim->synchronizer);
+	pthread_cond_destroy(&sim->LaunchSignal);
+	pthread_mutex_destroy(&sim->LaunchLock);
+	sim->launched = 0;
+	return SIM_THREAD_ERROR;
+}
+
+//Splits the list into tasks of roughly equal estimated cost and deals them out to the worker deques
+void PartitionTasks(simulation *sim)
+{
+	int n = sim->totalbodies;
+	int tasks = sim->totaltasks;
+	
+	//Add up the cost of the whole list, body by body
+	double total = 0;
+	for (int i = 0; i < n; i++)
+	{
+		total += sim->cost[sim->index[i]];
+	}
+	
+	//Close each task once its share of the total cost is reached
+	double share = total / tasks;
+	double running = 0;
+	int first = 0;
+	int t = 0;
+	for (int i = 0; i < n && t < tasks - 1; i++)
+	{
+		running += sim->cost[sim->index[i]];
+		
+		//Each task keeps at least one body and leaves at least one for every task after it
+		if ((running >= share * (t + 1) && n - (i + 1) >= tasks - (t + 1)) || n - (i + 1) == tasks - (t + 1))
+		{
+			sim->tasks[t].first = first;
+			sim->tasks[t].last = i + 1;
+			first = i + 1;
+			t++;
+		}
+	}
+	sim->tasks[t].first = first;
+	sim->tasks[t].last = n;
+	
+	//Give each worker a contiguous run of tasks, so a worker mostly stays in one region of space
+	for (int w = 0; w < sim->threads; w++)
+	{
+		TaskDeque *deque = &sim->deques[w];
+		deque->top = tasks * w / sim->threads;
+		deque->bottom = tasks * (w + 1) / sim->threads;
+	}
+}
+
+//Takes the next task from a worker's own deque, from the end opposite to thieves
+int PopTask(TaskDeque *deque)
+{
+	int task = -1;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom > deque->top)
+	{
+		deque->bottom--;
+		task = deque->bottom;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+//Takes the oldest task from another worker's deque
+int StealTask(TaskDeque *deque)
+{
+	int task = -1;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom > deque->top)
+	{
+		task = deque->top;
+		deque->top++;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+//Runs one task and records how long it took per body
+void RunTask(simulation *sim, int task)
+{
+	struct timespec start;
+	struct timespec stop;
+	SimTask *t = &sim->tasks[task];
+	
+	//A search for close pairs is split like a step, but its time is not a step's cost
+	if (sim->searching)
+	{
+		NearestPartners(sim, t->first, t->last);
+		return;
+	}
+	
+	t->close = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = t->first; i < t->last; i++)
+	{
+		//Bodies driven by an ephemeris are not integrated, and a close pair is stepped once, from its lower input number
+		int k = sim->index[i];
+		if (sim->driven != NULL && sim->driven[k] >= 0)
+		{
+			continue;
+		}
+		if (sim->partner[k] >= 0)
+		{
+			if (sim->partner[k] > k)
+			{
+				StepPair(sim, i, &t->close);
+			}
+			continue;
+		}
+		StepBody(sim->list, SimOrder(sim), i, sim->totalbodies, &sim->NewP[i], &sim->NewV[i], &t->close);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	
+	//Blend the new measurement into each body's estimate to smooth out timer noise
+	double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) * 1e-9;
+	double each = seconds / (t->last - t->first);
+	for (int i = t->first; i < t->last; i++)
+	{
+		double *cost = &sim->cost[sim->index[i]];
+		*cost = 0.5 * (*cost + each);
+	}
+}
+
+//Function for a worker thread, which runs tasks from its own deque and then steals from the others
+static void* SimThread(void *arg)
+{
+	//Re-cast passed arguments as ThreadData struct
+	ThreadData *argument = (ThreadData*) arg;
+	simulation *sim = argument->sim;
+	int num = argument->num;
+	
+	//Wait until the whole pool has been created
+	pthread_mutex_lock(&sim->LaunchLock);
+	while (!sim->launched)
+	{
+		pthread_cond_wait(&sim->LaunchSignal, &sim->LaunchLock);
+	}
+	pthread_mutex_unlock(&sim->LaunchLock);
+	
+	if (sim->launched != 1)
+	{
+		return NULL;
+	}
+	
+	while (1)
+	{
+		//Wait here until the next step has been partitioned
+		pthread_barrier_wait(&sim->synchronizer);
+		
+		//Until the value is set to zero, the simulation loop continues
+		if (!sim->running)
+		{
+			break;
+		}
+		
+		//Work through this thread's own tasks first
+		int task;
+		while ((task = PopTask(&sim->deques[num])) != -1)
+		{
+			RunTask(sim, task);
+		}
+		
+		//Then take work from the other workers until every deque is empty
+		for (int k = 1; k < sim->threads; k++)
+		{
+			TaskDeque *victim = &sim->deques[(num + k) % sim->threads];
+			while ((task = StealTask(victim)) != -1)
+			{
+				RunTask(sim, task);
+			}
+		}
+		
+		//Wait here until every worker has finished the step
+		pthread_barrier_wait(&sim->synchronizer);
+	}
+	
+	//return nothing useful
+	return NULL;
+}
+
+
+//--------------------
+//Function Definitions
+//Memory Functions
+//--------------------
+
+//Rounds a size up to a whole number of aligned pieces
+size_t Aligned(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+//Maps one block of memory large enough for everything that will be taken from it
+//Blocks of a few huge pages or more are aligned to them and marked for huge pages, where the system has them
+SimStatus ArenaCreate(arena *a, size_t size)
+{
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t mapped = (size + page - 1) / page * page;
+	size_t align = page;
+	
+#ifdef MADV_HUGEPAGE
+	if (size >= 4 * HUGE_PAGE)
+	{
+		mapped = (size + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+		align = HUGE_PAGE;
+	}
+#endif
+	
+	//Map extra so the block can start on a boundary, then give back what lies either side of it
+	size_t extra = align - page;
+	unsigned char *map = mmap(NULL, mapped + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return SIM_BAD_MALLOC;
+	}
+	
+	unsigned char *base = (unsigned char*) (((size_t) map + align - 1) & ~(align - 1));
+	if (base > map)
+	{
+		munmap(map, base - map);
+	}
+	if (base + mapped < map + mapped + extra)
+	{
+		munmap(base + mapped, (map + mapped + extra) - (base + mapped));
+	}
+	
+	*a = (arena) {.base = base, .size = size, .mapped = mapped, .used = 0, .huge = 0};
+	
+#ifdef MADV_HUGEPAGE
+	if (align == HUGE_PAGE)
+	{
+		a->huge = (madvise(base, mapped, MADV_HUGEPAGE) == 0);
+	}
+#endif
+	return SIM_OK;
+}
+
+//Takes an aligned, zeroed piece from an arena, or returns NULL if the arena was sized too small
+//Pieces must fit in the size planned, not just the pages mapped, so a piece left out of the sizing fails at once
+void* ArenaAlloc(arena *a, size_t size)
+{
+	size = Aligned(size);
+	if (a->used + size > a->size)
+	{
+		return NULL;
+	}
+	void *piece = a->base + a->used;
+	a->used = a->used + size;
+	return piece;
+}
+
+//Gives an arena's block back to the system
+void ArenaFree(arena *a)
+{
+	if (a->base != NULL)
+	{
+		munmap(a->base, a->mapped);
+		a->base = NULL;
+	}
+}
+
+//Returns the number of hash slots used to intern n names, a power of two at least twice n
+unsigned long NameSlots(int n)
+{
+	unsigned long slots = 1;
+	while (slots < 2 * (unsigned long) n)
+	{
+		slots = slots << 1;
+	}
+	return slots;
+}
+
+//Sets up a table over space for the text of the names and for NameSlots hash slots, both zeroed
+void NameTableInit(NameTable *table, char *text, unsigned int *slots, int n)
+{
+	table->text = text;
+	table->used = 0;
+	table->slots = slots;
+	table->mask = NameSlots(n) - 1;
+}
+
+//Returns the table's copy of a name, adding it the first time it is seen
+//The text must have room for every name added, which is at most the length of each name plus one
+const char* NameIntern(NameTable *table, const char *name)
+{
+	if (name == NULL)
+	{
+		name = "";
+	}
+	
+	//FNV-1a hash of the name, then the slots are searched in order from there
+	unsigned long hash = 2166136261UL;
+	for (const char *c = name; *c != '\0'; c++)
+	{
+		hash = (hash ^ (unsigned char) *c) * 16777619UL;
+	}
+	
+	//Slots hold an offset into the text plus one, so zero is an empty slot
+	unsigned long s = hash & table->mask;
+	while (table->slots[s] != 0)
+	{
+		const char *found = table->text + table->slots[s] - 1;
+		if (strcmp(found, name) == 0)
+		{
+			return found;
+		}
+		s = (s + 1) & table->mask;
+	}
+	
+	size_t length = strlen(name) + 1;
+	memcpy(table->text + table->used, name, length);
+	table->slots[s] = (unsigned int) table->used + 1;
+	table->used = table->used + length;
+	return table->text + table->slots[s] - 1;
+}
@@ -0,0 +1,220 @@
+//Simulation library: the types and functions another program needs to run simulations
+//Each simulation is held by an opaque handle, and is read and changed only through the functions below
+#ifndef ORBIT_SIM_H
+#define ORBIT_SIM_H
+
+//--------------------------------
+//Preprocessor Commands and Macros
+//--------------------------------
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define GRAV_CONST 6.67408e-11
+
+//Stack size of each worker thread, far more than a step needs
+#define WORKER_STACK (64 * 1024)
+//Distance in meters and speed in meters per second by which a driven body's input may differ from its ephemeris at the start
+#define EPHEMERIS_TOLERANCE 1000.0
+#define EPHEMERIS_SPEED_TOLERANCE 0.01
+
+//------------------
+//Custom data types
+//------------------
+
+typedef struct
+{
+	double x;
+	double y;
+	double z;
+} vector;
+
+//Each body is kept compact, with the position and mu read by every force sum first
+//Names are kept once each in a table, which the body points into
+typedef struct
+{
+	vector p;
+	double mu;
+	vector v;
+	double mass;
+	const char *name;
+} body;
+
+//One block of memory, mapped up front and handed out in aligned pieces
+typedef struct
+{
+	unsigned char *base;
+	size_t size;
+	size_t mapped;
+	size_t used;
+	int huge;
+} arena;
+
+//Names kept once each, found through a hash of offsets into the text
+typedef struct
+{
+	char *text;
+	size_t used;
+	unsigned int *slots;
+	unsigned long mask;
+} NameTable;
+
+//Status codes returned by the simulation library
+typedef enum
+{
+	SIM_OK = 0,
+	SIM_BAD_MALLOC,
+	SIM_THREAD_ERROR,
+	SIM_INVALID_MASS,
+	SIM_INSUFFICIENT_OBJECTS,
+	SIM_FILE_ERROR,
+	SIM_EPHEMERIS_RANGE,
+	SIM_INVALID
+} SimStatus;
+
+//Header at the start of an ephemeris file
+//It is followed by the name of each body, then for each segment the coefficients of x, y and z for each body
+//Coordinates are relative to the frame of the recording run, whose origin was at origin at time zero and moves at drift
+typedef struct
+{
+	unsigned int magic;
+	int totalbodies;
+	int degree;
+	unsigned long segments;
+	double start;
+	double span;
+	vector origin;
+	vector drift;
+} EphemerisHeader;
+
+typedef struct
+{
+	EphemerisHeader header;
+	char (*names)[96];
+	double *coeff;
+} ephemeris;
+
+//Simulation handle, used only through the library functions
+typedef struct simulation simulation;
+
+typedef struct
+{
+	double mass;
+	vector momentum;
+	vector moment;
+} SystemSums;
+
+//Header at the start of a stream file
+typedef struct
+{
+	unsigned int magic;
+	int totalbodies;
+	unsigned long capacity;
+	unsigned long framesize;
+	unsigned long NameOffset;
+	unsigned long FrameOffset;
+	_Atomic unsigned long sequence;
+} StreamHeader;
+
+//One slot of the ring, holding positions in input order
+//The sequence is the frame number plus one, or zero while the slot is being written
+typedef struct
+{
+	_Atomic unsigned long sequence;
+	unsigned long simtime;
+	vector p[];
+} StreamFrame;
+
+typedef struct
+{
+	FILE *file;
+	int count;
+	int *bodies;
+	int samples;
+	unsigned long segments;
+	vector *sample;
+	double *basis;
+	double *fit;
+	double *coeff;
+} recorder;
+
+typedef struct
+{
+	StreamHeader *header;
+	char (*names)[96];
+	unsigned char *frames;
+	size_t size;
+	int fd;
+} stream;
+
+//-------------------
+//Function Prototypes
+//-------------------
+
+//Coordinate substitution functions
+SimStatus SumSystem(const body *, int, int, SystemSums *);
+SimStatus SetRelative(body *, int, int, vector *, vector *);
+
+//vector functions
+vector VectorAdd(vector, vector);
+vector VectorSubtract(vector, vector);
+vector VectorMult(vector, double);
+vector VectorMultVector(vector, vector);
+vector VectorDivideBy(vector, double);
+double VectorMagnitudeSquared(vector);
+
+//Simulation functions
+double InverseCube(double);
+
+//Library functions
+SimStatus SimCreate(simulation **, const body *, int, int);
+SimStatus SimStep(simulation *, unsigned long);
+const body* SimState(const simulation *);
+const int* SimIndex(const simulation *);
+unsigned long SimTime(const simulation *);
+unsigned long SimCloseEncounters(const simulation *);
+void SimSetDeterministic(simulation *, int);
+void SimSetSpecialized(simulation *, int);
+void SimSetRegularized(simulation *, int);
+void SimSetFrame(simulation *, vector, vector);
+size_t SimMemory(const simulation *);
+int SimBodies(const simulation *);
+const int* SimSlot(const simulation *);
+int SimHugePages(const simulation *);
+int SimSpecialized(const simulation *);
+SimStatus SimUseEphemeris(simulation *, const ephemeris *, int *, int *);
+void SimDestroy(simulation *);
+
+//Ephemeris functions
+SimStatus EphemerisRecordStart(recorder *, const char *, const simulation *, const char *);
+void EphemerisRecord(recorder *, const simulation *);
+void EphemerisRecordFinish(recorder *);
+SimStatus EphemerisLoad(ephemeris *, const char *);
+SimStatus EphemerisState(const ephemeris *, int, double, vector *, vector *);
+void EphemerisFree(ephemeris *);
+
+//Frame stream functions
+SimStatus StreamCreate(stream *, const char *, const body *, int, unsigned long);
+void StreamPush(stream *, const simulation *);
+SimStatus StreamOpen(stream *, const char *);
+const StreamFrame* StreamLatest(const stream *, unsigned long *);
+int StreamFrameValid(const StreamFrame *, unsigned long);
+void StreamClose(stream *);
+
+//Work scheduling functions
+int WorkerCount(int);
+
+//Spatial ordering functions
+int CountProcessors();
+SimStatus RunParallel(void *(*)(void *), void *, size_t, int);
+
+//Memory functions
+size_t Aligned(size_t);
+SimStatus ArenaCreate(arena *, size_t);
+void* ArenaAlloc(arena *, size_t);
+void ArenaFree(arena *);
+unsigned long NameSlots(int);
+void NameTableInit(NameTable *, char *, unsigned int *, int);
+const char* NameIntern(NameTable *, const char *);
+
+#endif